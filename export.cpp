@@ -1,8 +1,15 @@
+#include <algorithm>
+#include <cstring>
 #include <string>
 #include <stdexcept>
 #include "seekgzip.h"
 #include "export.h"
 
+// Sizes of the data decompressed ahead just after a seek, and at most; the
+// size doubles on every refill while the data is read sequentially.
+static const size_t readahead_min = 4096;
+static const size_t buffer_size = 1048576;
+
 static std::string error_string(int errorcode)
 {
     switch (errorcode) {
@@ -22,13 +29,44 @@ static std::string error_string(int errorcode)
         return "Imcompatible data format";
     case SEEKGZIP_ZLIBERROR:
         return "ZLIB error";
+    case SEEKGZIP_STALEINDEX:
+        return "Index file is out of date";
     default:
     case SEEKGZIP_ERROR:
         return "Unknown error";
     }
 }
 
-reader::reader(const char *filename)
+// Lock of a reader for the scope; the Python module calls the methods of a
+// reader without the GIL, which no longer serializes the calls.
+class reader_lock
+{
+protected:
+    pthread_mutex_t *m_mutex;
+
+public:
+    reader_lock(pthread_mutex_t *mutex) : m_mutex(mutex)
+    {
+        pthread_mutex_lock(m_mutex);
+    }
+
+    ~reader_lock()
+    {
+        pthread_mutex_unlock(m_mutex);
+    }
+};
+
+// Initialize a recursive mutex, which lets methods call other methods.
+static void init_mutex(pthread_mutex_t *mutex)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+reader::reader(const char *filename) : m_pos(0), m_readahead(readahead_min)
 {
     int err = 0;
     seekgzip_t* sgz = seekgzip_open(filename, &err);
@@ -36,56 +74,309 @@ reader::reader(const char *filename)
     if (sgz == NULL) {
         throw std::invalid_argument(error_string(err));
     }
+    init_mutex(&m_mutex);
+}
+
+reader::reader(void *obj) : m_obj(obj), m_pos(0), m_readahead(readahead_min)
+{
+    init_mutex(&m_mutex);
 }
 
 reader::~reader()
 {
     this->close();
+    pthread_mutex_destroy(&m_mutex);
 }
 
 void reader::close()
 {
+    reader_lock lock(&m_mutex);
     if (m_obj != NULL) {
         seekgzip_close(reinterpret_cast<seekgzip_t*>(m_obj));
         m_obj = NULL;
     }
+    m_buffer.clear();
+    m_pos = 0;
+}
+
+reader* reader::dup()
+{
+    reader_lock lock(&m_mutex);
+    if (m_obj == NULL) {
+        throw std::invalid_argument(error_string(SEEKGZIP_ERROR));
+    }
+
+    // The new reader shares the index, but has its own file and inflate state.
+    int err = 0;
+    seekgzip_t* sgz = seekgzip_dup(reinterpret_cast<seekgzip_t*>(m_obj), &err);
+    if (sgz == NULL) {
+        throw std::invalid_argument(error_string(err));
+    }
+    return new reader(sgz);
 }
 
 void reader::seek(long long offset)
 {
+    reader_lock lock(&m_mutex);
     if (m_obj != NULL) {
-        seekgzip_seek(
-            reinterpret_cast<seekgzip_t*>(m_obj),
-            offset
-            );
+        // The buffer ends at the offset of the seekgzip_t instance.
+        long long end = seekgzip_tell(reinterpret_cast<seekgzip_t*>(m_obj));
+        long long begin = end - (long long)m_buffer.size();
+        if (begin <= offset && offset <= end) {
+            m_pos = (size_t)(offset - begin);
+        } else {
+            m_buffer.clear();
+            m_pos = 0;
+            m_readahead = readahead_min;
+            seekgzip_seek(
+                reinterpret_cast<seekgzip_t*>(m_obj),
+                offset
+                );
+        }
     }
 }
 
 long long reader::tell()
 {
+    reader_lock lock(&m_mutex);
     if (m_obj != NULL) {
         return seekgzip_tell(
             reinterpret_cast<seekgzip_t*>(m_obj)
-            );
+            ) - (long long)(m_buffer.size() - m_pos);
     } else {
         return -1;    
     }
 }
 
-std::string reader::read(int size)
+bool reader::fill(size_t size)
 {
-    std::string ret;
+    m_buffer.clear();
+    m_pos = 0;
     if (m_obj != NULL) {
-        char *buffer = new char[size+1];
+        // Decompress the data requested, or the read-ahead if larger.
+        size = std::min(std::max(size, m_readahead), (size_t)0x40000000);
+        m_readahead = std::min(m_readahead * 2, buffer_size);
+        m_buffer.resize(size);
         int n = seekgzip_read(
             reinterpret_cast<seekgzip_t*>(m_obj),
-            buffer,
-            size
+            &m_buffer[0],
+            (int)size
             );
-        buffer[n] = 0;
-        ret = buffer;
-        delete[] buffer;
+        if (n < 0) {
+            m_buffer.clear();
+            throw std::runtime_error(error_string(SEEKGZIP_DATAERROR));
+        }
+        m_buffer.resize(n);
+    }
+    return !m_buffer.empty();
+}
+
+std::string reader::read(int size)
+{
+    reader_lock lock(&m_mutex);
+    std::string ret;
+    while ((int)ret.size() < size) {
+        if (m_pos == m_buffer.size() && !this->fill((size_t)size - ret.size())) {
+            break;
+        }
+        size_t n = std::min(m_buffer.size() - m_pos, (size_t)size - ret.size());
+        ret.append(m_buffer, m_pos, n);
+        m_pos += n;
+    }
+    return ret;
+}
+
+std::string reader::readline(int size)
+{
+    reader_lock lock(&m_mutex);
+    std::string ret;
+    while (size < 0 || (int)ret.size() < size) {
+        if (m_pos == m_buffer.size() && !this->fill(0)) {
+            break;
+        }
+
+        // Find the end of the line in the buffer (up to size bytes).
+        size_t n = m_buffer.size() - m_pos;
+        if (0 <= size && (size_t)size - ret.size() < n) {
+            n = (size_t)size - ret.size();
+        }
+        const char *p = m_buffer.data() + m_pos;
+        const char *eol = reinterpret_cast<const char*>(std::memchr(p, '\n', n));
+        if (eol != NULL) {
+            n = eol - p + 1;
+        }
+
+        ret.append(p, n);
+        m_pos += n;
+        if (eol != NULL) {
+            break;
+        }
+    }
+    return ret;
+}
+
+std::vector<std::string> reader::readlines(int hint)
+{
+    reader_lock lock(&m_mutex);
+    size_t total = 0;
+    std::vector<std::string> ret;
+    for (;;) {
+        std::string line = this->readline();
+        if (line.empty()) {
+            break;
+        }
+        total += line.size();
+        ret.push_back(line);
+        if (0 < hint && (size_t)hint <= total) {
+            break;
+        }
+    }
+    return ret;
+}
+
+// Comparator of the indices of reads by their offsets.
+struct offset_less
+{
+    const std::vector<long long>& offsets;
+
+    offset_less(const std::vector<long long>& offsets) : offsets(offsets)
+    {
+    }
+
+    bool operator()(size_t x, size_t y) const
+    {
+        return offsets[x] < offsets[y];
+    }
+};
+
+std::vector<std::string> reader::read_batch(const std::vector<long long>& offsets, const std::vector<int>& sizes)
+{
+    reader_lock lock(&m_mutex);
+    if (offsets.size() != sizes.size()) {
+        throw std::invalid_argument("The numbers of offsets and sizes differ");
+    }
+
+    std::vector<std::string> ret(offsets.size());
+    if (m_obj == NULL) {
+        return ret;
+    }
+    seekgzip_t* sgz = reinterpret_cast<seekgzip_t*>(m_obj);
+    long long pos = this->tell();
+
+    // Read in the order of the offsets so that the inflate state continues
+    // from one read to the next; the buffer of the reader is bypassed.
+    std::vector<size_t> order(offsets.size());
+    for (size_t i = 0;i < order.size();++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), offset_less(offsets));
+
+    m_buffer.clear();
+    m_pos = 0;
+    for (size_t i = 0;i < order.size();++i) {
+        std::string& data = ret[order[i]];
+        if (sizes[order[i]] <= 0) {
+            continue;
+        }
+        data.resize(sizes[order[i]]);
+        seekgzip_seek(sgz, offsets[order[i]]);
+        int n = seekgzip_read(sgz, &data[0], (int)data.size());
+        if (n < 0) {
+            seekgzip_seek(sgz, pos);
+            throw std::runtime_error(error_string(SEEKGZIP_DATAERROR));
+        }
+        data.resize(n);
     }
+
+    // Restore the position of the reader.
+    seekgzip_seek(sgz, pos);
     return ret;
 }
 
+seekgzip_streambuf::seekgzip_streambuf(const char *filename, size_t buffer_size)
+    : m_buffer(buffer_size)
+{
+    int err = 0;
+    seekgzip_t* sgz = seekgzip_open(filename, &err);
+    m_obj = sgz;
+    if (sgz == NULL) {
+        throw std::invalid_argument(error_string(err));
+    }
+    this->setg(&m_buffer[0], &m_buffer[0], &m_buffer[0]);
+}
+
+seekgzip_streambuf::~seekgzip_streambuf()
+{
+    if (m_obj != NULL) {
+        seekgzip_close(reinterpret_cast<seekgzip_t*>(m_obj));
+        m_obj = NULL;
+    }
+}
+
+seekgzip_streambuf::int_type seekgzip_streambuf::underflow()
+{
+    if (this->gptr() < this->egptr()) {
+        return traits_type::to_int_type(*this->gptr());
+    }
+
+    // Continue the inflate stream directly into the get area.
+    char *begin = &m_buffer[0];
+    int n = seekgzip_read(
+        reinterpret_cast<seekgzip_t*>(m_obj),
+        begin,
+        (int)m_buffer.size()
+        );
+    if (n < 0) {
+        // The istream catches this and sets badbit, unlike the end of data.
+        this->setg(begin, begin, begin);
+        throw std::runtime_error(error_string(SEEKGZIP_DATAERROR));
+    }
+    if (n == 0) {
+        this->setg(begin, begin, begin);
+        return traits_type::eof();
+    }
+    this->setg(begin, begin, begin + n);
+    return traits_type::to_int_type(*this->gptr());
+}
+
+seekgzip_streambuf::pos_type seekgzip_streambuf::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+{
+    seekgzip_t* sgz = reinterpret_cast<seekgzip_t*>(m_obj);
+    off_type base = 0;
+    if (dir == std::ios_base::cur) {
+        // The get area ends at the offset of the seekgzip_t instance.
+        base = (off_type)seekgzip_tell(sgz) - (this->egptr() - this->gptr());
+        if (off == 0) {
+            return pos_type(base);
+        }
+    } else if (dir == std::ios_base::end) {
+        base = (off_type)seekgzip_size(sgz);
+    }
+    return this->seekpos(pos_type(base + off), which);
+}
+
+seekgzip_streambuf::pos_type seekgzip_streambuf::seekpos(pos_type pos, std::ios_base::openmode which)
+{
+    seekgzip_t* sgz = reinterpret_cast<seekgzip_t*>(m_obj);
+    off_type offset = (off_type)pos;
+    if (!(which & std::ios_base::in) || offset < 0) {
+        return pos_type(off_type(-1));
+    }
+
+    // Move within the get area if possible; otherwise seek through the index.
+    off_type end = (off_type)seekgzip_tell(sgz);
+    off_type begin = end - (this->egptr() - this->eback());
+    if (begin <= offset && offset <= end) {
+        this->setg(this->eback(), this->eback() + (offset - begin), this->egptr());
+    } else {
+        seekgzip_seek(sgz, (off_t)offset);
+        this->setg(&m_buffer[0], &m_buffer[0], &m_buffer[0]);
+    }
+    return pos;
+}
+
+seekgzip_istream::seekgzip_istream(const char *filename, size_t buffer_size)
+    : std::istream(NULL), m_streambuf(filename, buffer_size)
+{
+    this->rdbuf(&m_streambuf);
+}
@@ -2,11 +2,21 @@
 #define __EXPORT_H__
 
 #include <string>
+#include <vector>
+#include <pthread.h>
+#ifndef SWIG
+#include <istream>
+#include <streambuf>
+#endif/*SWIG*/
 
 class reader
 {
 protected:
     void *m_obj;
+    std::string m_buffer;
+    size_t m_pos;
+    size_t m_readahead;
+    pthread_mutex_t m_mutex;
 
 public:
     reader(const char *filename);
@@ -15,12 +25,56 @@ public:
 
     void close();
 
+    reader* dup();
+
     void seek(long long offset);
 
     long long tell();
 
     std::string read(int size);
+
+    std::string readline(int size = -1);
+
+    std::vector<std::string> readlines(int hint = -1);
+
+    std::vector<std::string> read_batch(const std::vector<long long>& offsets, const std::vector<int>& sizes);
+
+protected:
+    reader(void *obj);
+
+    bool fill(size_t size);
 };
 
-#endif/*__EXPORT_H__*/
+#ifndef SWIG
+
+class seekgzip_streambuf : public std::streambuf
+{
+protected:
+    void *m_obj;
+    std::vector<char> m_buffer;
+
+public:
+    seekgzip_streambuf(const char *filename, size_t buffer_size = 1048576);
 
+    virtual ~seekgzip_streambuf();
+
+protected:
+    virtual int_type underflow();
+
+    virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which);
+
+    virtual pos_type seekpos(pos_type pos, std::ios_base::openmode which);
+};
+
+class seekgzip_istream : public std::istream
+{
+protected:
+    seekgzip_streambuf m_streambuf;
+
+public:
+    seekgzip_istream(const char *filename, size_t buffer_size = 1048576);
+};
+
+#endif/*SWIG*/
+
+#endif/*__EXPORT_H__*/
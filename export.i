@@ -1,12 +1,23 @@
-%module seekgzip
+%module(threads="1") seekgzip
 
 %{
 #include "export.h"
 %}
 
 %include "std_string.i"
+%include "std_vector.i"
 %include "exception.i"
 
+%template(StringVector) std::vector<std::string>;
+%template(OffsetVector) std::vector<long long>;
+%template(SizeVector) std::vector<int>;
+
+// The module releases the GIL in the methods, which decompress and read the
+// file, so that readers in other Python threads run meanwhile; a reader locks
+// itself in the methods instead.
+
+%newobject reader::dup;
+
 %exception {
     try {
         $action
@@ -21,4 +32,27 @@
     }
 }
 
+%pythonappend reader::readlines %{
+    val = list(val)
+%}
+
+%pythonappend reader::read_batch %{
+    val = list(val)
+%}
+
 %include "export.h"
+
+%extend reader {
+%pythoncode %{
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        line = self.readline()
+        if not line:
+            raise StopIteration
+        return line
+
+    next = __next__
+%}
+}
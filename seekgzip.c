@@ -17,6 +17,11 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include <zlib.h>
 #include "seekgzip.h"
 
@@ -82,6 +87,7 @@ struct point {
     off_t out;          /* corresponding offset in uncompressed data */
     off_t in;           /* offset in input file of first full byte */
     int bits;           /* number of bits (1-7) from byte at in - 1, or 0 */
+    uLong crc;          /* CRC-32 of the uncompressed data up to the next point */
     unsigned char window[WINSIZE];  /* preceding 32K of uncompressed data */
 };
 
@@ -89,6 +95,7 @@ struct point {
 struct access {
     int have;           /* number of list entries filled in */
     int size;           /* number of list entries allocated */
+    off_t length;       /* total length of the uncompressed data */
     struct point *list; /* allocated list */
 };
 
@@ -137,6 +144,7 @@ static struct access *addpoint(struct access *index, int bits,
     next->bits = bits;
     next->in = in;
     next->out = out;
+    next->crc = crc32(0L, Z_NULL, 0);
     if (left)
         memcpy(next->window, window + WINSIZE - left, left);
     if (left < WINSIZE)
@@ -170,6 +178,10 @@ struct point *findpoint(struct access *index, off_t offset)
 }
 #endif/*SEEKGZIP_OPTIMIZATION*/
 
+/* copy of the compressed data read by build_index(), defined below */
+struct tee;
+static int tee_write(struct tee *tee, const unsigned char *buf, size_t size);
+
 /* Make one entire pass through the compressed stream and build an index, with
    access points about every span bytes of uncompressed output -- span is
    chosen to balance the speed of random access against the memory requirements
@@ -177,13 +189,20 @@ struct point *findpoint(struct access *index, off_t offset)
    of the first zlib or gzip stream in the file is ignored.  build_index()
    returns the number of access points on success (>= 1), Z_MEM_ERROR for out
    of memory, Z_DATA_ERROR for an error in the input file, or Z_ERRNO for a
-   file read error.  On success, *built points to the resulting index. */
-static int build_index(FILE *in, off_t span, struct access **built)
+   file read error.  On success, *built points to the resulting index.  The
+   index also records the CRC-32 of the uncompressed data of each span, and
+   the total length of the uncompressed data.  Unless tee is NULL, the
+   compressed data read from in is also written to tee, and a write error is
+   reported as Z_ERRNO. */
+static int build_index(FILE *in, struct tee *tee, off_t span, struct access **built)
 {
     int ret;
+    unsigned left;              /* avail_out before the call to inflate() */
     off_t totin, totout;        /* our own total counters to avoid 4GB limit */
     off_t last;                 /* totout value of last access point */
+    uLong crc;                  /* CRC-32 of the current span */
     struct access *index;       /* access points being generated */
+    struct point *next;
     z_stream strm;
     unsigned char input[CHUNK];
     unsigned char window[WINSIZE];
@@ -202,6 +221,8 @@ static int build_index(FILE *in, off_t span, struct access **built)
        also validates the integrity of the compressed data using the check
        information at the end of the gzip or zlib stream */
     totin = totout = last = 0;
+    crc = crc32(0L, Z_NULL, 0);
+    memset(window, 0, WINSIZE);     /* the first point has no preceding data */
     index = NULL;               /* will be allocated by first addpoint() */
     strm.avail_out = 0;
     do {
@@ -216,6 +237,10 @@ static int build_index(FILE *in, off_t span, struct access **built)
             goto build_index_error;
         }
         strm.next_in = input;
+        if (tee != NULL && tee_write(tee, input, strm.avail_in)) {
+            ret = Z_ERRNO;
+            goto build_index_error;
+        }
 
         /* process all of that, or until end of stream */
         do {
@@ -224,6 +249,7 @@ static int build_index(FILE *in, off_t span, struct access **built)
                 strm.avail_out = WINSIZE;
                 strm.next_out = window;
             }
+            left = strm.avail_out;
 
             /* inflate until out of input, output, or at end of block --
                update the total input and output counters */
@@ -236,6 +262,11 @@ static int build_index(FILE *in, off_t span, struct access **built)
                 ret = Z_DATA_ERROR;
             if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
                 goto build_index_error;
+
+            /* accumulate the checksum of the current span from the data that
+               inflate() has just written at the end of the window */
+            crc = crc32(crc, window + (WINSIZE - left),
+                        left - strm.avail_out);
             if (ret == Z_STREAM_END)
                 break;
 
@@ -250,6 +281,10 @@ static int build_index(FILE *in, off_t span, struct access **built)
              */
             if ((strm.data_type & 128) && !(strm.data_type & 64) &&
                 (totout == 0 || totout - last > span)) {
+                if (index != NULL) {
+                    index->list[index->have - 1].crc = crc;
+                    crc = crc32(0L, Z_NULL, 0);
+                }
                 index = addpoint(index, strm.data_type & 7, totin,
                                  totout, strm.avail_out, window);
                 if (index == NULL) {
@@ -263,7 +298,11 @@ static int build_index(FILE *in, off_t span, struct access **built)
 
     /* clean up and return index (release unused entries in list) */
     (void)inflateEnd(&strm);
-    index = (struct access*)realloc(index, sizeof(struct point) * index->have);
+    index->list[index->have - 1].crc = crc;
+    index->length = totout;
+    next = (struct point*)realloc(index->list, sizeof(struct point) * index->have);
+    if (next != NULL)
+        index->list = next;
     index->size = index->have;
     *built = index;
     return index->size;
@@ -397,6 +436,210 @@ static int extract(FILE *in, struct access *index, off_t offset,
 
 
 
+#define INDEX_VERSION 1     /* version of the index format */
+#define FPSIZE 4096         /* size of the head and tail in a fingerprint */
+#define OUTCHUNK 131072     /* output buffer size for scanning a stream */
+#define COPYCHUNK 1048576   /* output buffer size for copying to a file */
+
+/* Receives a piece of the uncompressed data from scan(), which starts at the
+   offset in the uncompressed data; a nonzero return value stops the scan. */
+typedef int (*scan_callback)(void *instance, off_t offset,
+                             const unsigned char *data, unsigned size);
+
+/* Decompress the stream from the access point here, discard the data before
+   offset, and pass the next len bytes (or all bytes up to the end of the
+   stream if len is negative) to cb, in pieces of at most size bytes stored in
+   buf.  Unlike extract(), the length of the data is not limited by the size
+   of a buffer.  scan() returns the number of bytes passed to cb, or a negative
+   error code (Z_DATA_ERROR, Z_MEM_ERROR, or Z_ERRNO) as extract() does. */
+static off_t scan(FILE *in, struct point *here, off_t offset, off_t len,
+                  unsigned char *buf, unsigned size,
+                  scan_callback cb, void *instance)
+{
+    int ret;
+    unsigned want;
+    off_t skip, total = 0;
+    z_stream strm;
+    unsigned char input[CHUNK];
+
+    /* initialize file and inflate state to start there */
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    ret = inflateInit2(&strm, -15);         /* raw inflate */
+    if (ret != Z_OK)
+        return ret;
+    if (fseeko(in, here->in - (here->bits ? 1 : 0), SEEK_SET) == -1) {
+        ret = Z_ERRNO;
+        goto scan_ret;
+    }
+    if (here->bits) {
+        ret = getc(in);
+        if (ret == -1) {
+            ret = ferror(in) ? Z_ERRNO : Z_DATA_ERROR;
+            goto scan_ret;
+        }
+        (void)inflatePrime(&strm, here->bits, ret >> (8 - here->bits));
+    }
+    (void)inflateSetDictionary(&strm, here->window, WINSIZE);
+
+    /* discard the data until offset, then pass the requested data to cb */
+    skip = offset - here->out;
+    ret = Z_OK;
+    while (ret != Z_STREAM_END && (len < 0 || total < len)) {
+        /* fill the buffer up to the offset, or up to the end of the range */
+        want = size;
+        if (0 < skip && skip < want)
+            want = (unsigned)skip;
+        else if (skip == 0 && 0 <= len && len - total < want)
+            want = (unsigned)(len - total);
+        strm.avail_out = want;
+        strm.next_out = buf;
+
+        /* uncompress until avail_out filled, or end of stream */
+        do {
+            if (strm.avail_in == 0) {
+                strm.avail_in = fread(input, 1, CHUNK, in);
+                if (ferror(in)) {
+                    ret = Z_ERRNO;
+                    goto scan_ret;
+                }
+                if (strm.avail_in == 0) {
+                    ret = Z_DATA_ERROR;
+                    goto scan_ret;
+                }
+                strm.next_in = input;
+            }
+            ret = inflate(&strm, Z_NO_FLUSH);       /* normal inflate */
+            if (ret == Z_NEED_DICT)
+                ret = Z_DATA_ERROR;
+            if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
+                goto scan_ret;
+        } while (strm.avail_out != 0 && ret != Z_STREAM_END);
+
+        /* skip or deliver what we got */
+        want -= strm.avail_out;
+        if (0 < skip) {
+            skip -= want;
+        } else if (0 < want) {
+            total += want;
+            if (cb(instance, offset + total - want, buf, want))
+                break;
+        }
+    }
+    ret = Z_OK;
+
+    /* clean up and return bytes passed or error */
+  scan_ret:
+    (void)inflateEnd(&strm);
+    return ret == Z_OK ? total : ret;
+}
+
+/* fingerprint of a compressed file, used for detecting a stale index */
+struct fingerprint {
+    off_t size;         /* size of the compressed file */
+    uint32_t head;      /* CRC-32 of the first FPSIZE bytes */
+    uint32_t tail;      /* CRC-32 of the last FPSIZE bytes */
+};
+
+static int get_fingerprint(FILE *fp, struct fingerprint *fpr)
+{
+    size_t size;
+    unsigned char buffer[FPSIZE];
+
+    // Obtain the size of the file.
+    if (fseeko(fp, 0, SEEK_END) != 0) {
+        return SEEKGZIP_READERROR;
+    }
+    fpr->size = ftello(fp);
+    if (fpr->size < 0) {
+        return SEEKGZIP_READERROR;
+    }
+    size = (fpr->size < FPSIZE) ? (size_t)fpr->size : FPSIZE;
+
+    // Compute checksums of the head and tail of the file.
+    if (fseeko(fp, 0, SEEK_SET) != 0 || fread(buffer, 1, size, fp) != size) {
+        return SEEKGZIP_READERROR;
+    }
+    fpr->head = (uint32_t)crc32(crc32(0L, Z_NULL, 0), buffer, size);
+    if (fseeko(fp, fpr->size - size, SEEK_SET) != 0 || fread(buffer, 1, size, fp) != size) {
+        return SEEKGZIP_READERROR;
+    }
+    fpr->tail = (uint32_t)crc32(crc32(0L, Z_NULL, 0), buffer, size);
+    return SEEKGZIP_SUCCESS;
+}
+
+/* copy of the compressed data, which takes the fingerprint of the copy */
+struct tee {
+    FILE *fp;                   /* destination of the copy */
+    off_t size;                 /* number of bytes written */
+    uLong head;                 /* CRC-32 of the first FPSIZE bytes */
+    unsigned char tail[FPSIZE]; /* ring buffer of the last FPSIZE bytes */
+};
+
+static int tee_write(struct tee *tee, const unsigned char *buf, size_t size)
+{
+    size_t n, pos;
+
+    if (fwrite(buf, 1, size, tee->fp) != size) {
+        return 1;
+    }
+
+    // Checksum the head of the data.
+    if (tee->size < FPSIZE) {
+        n = FPSIZE - (size_t)tee->size;
+        tee->head = crc32(tee->head, buf, (uInt)(size < n ? size : n));
+    }
+
+    // Keep the last FPSIZE bytes in the ring buffer.
+    if (FPSIZE < size) {
+        tee->size += (off_t)(size - FPSIZE);
+        buf += size - FPSIZE;
+        size = FPSIZE;
+    }
+    while (0 < size) {
+        pos = (size_t)(tee->size % FPSIZE);
+        n = FPSIZE - pos;
+        if (size < n) {
+            n = size;
+        }
+        memcpy(tee->tail + pos, buf, n);
+        tee->size += (off_t)n;
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static void tee_fingerprint(const struct tee *tee, struct fingerprint *fpr)
+{
+    size_t pos = (size_t)(tee->size % FPSIZE);
+
+    fpr->size = tee->size;
+    fpr->head = (uint32_t)tee->head;
+    if (tee->size < FPSIZE) {
+        fpr->tail = (uint32_t)crc32(crc32(0L, Z_NULL, 0), tee->tail, (uInt)tee->size);
+    } else {
+        fpr->tail = (uint32_t)crc32(crc32(crc32(0L, Z_NULL, 0), tee->tail + pos, FPSIZE - pos), tee->tail, pos);
+    }
+}
+
+static int zlib_error(int ret)
+{
+    switch (ret) {
+    case Z_MEM_ERROR:
+        return SEEKGZIP_OUTOFMEMORY;
+    case Z_DATA_ERROR:
+        return SEEKGZIP_DATAERROR;
+    case Z_ERRNO:
+        return SEEKGZIP_READERROR;
+    default:
+        return SEEKGZIP_ERROR;
+    }
+}
+
 static char *get_index_file(const char *target)
 {
     char *idx = (char*)malloc(strlen(target) + 4 + 1);
@@ -420,21 +663,84 @@ static uint32_t read_uint32(gzFile gz)
     return v;
 }
 
+static int write_offset(gzFile gz, off_t v)
+{
+    return gzwrite(gz, &v, sizeof(v));
+}
+
+static off_t read_offset(gzFile gz)
+{
+    off_t v;
+    gzread(gz, &v, sizeof(v));
+    return v;
+}
+
 struct tag_seekgzip
 {
     FILE *fp;
-    struct access index;
+    char *target;
+    struct fingerprint fpr;
+    struct access index;    /* read only once loaded, shared by seekgzip_dup() */
+    int *refcount;          /* number of the handles sharing index.list */
     off_t offset;
     int errorcode;
+    z_stream strm;          /* inflate state kept between seekgzip_read() calls */
+    int active;             /* nonzero if strm is initialized */
+    int end;                /* nonzero if strm reached the end of stream */
+    off_t in;               /* offset in input file of the next input */
+    off_t out;              /* offset in uncompressed data of the next output */
+    unsigned char input[CHUNK];
 };
 
+static int write_index(const char *target, const struct access *index, const struct fingerprint *fpr)
+{
+    int i, ret = SEEKGZIP_SUCCESS;
+    char *target_idx = NULL;
+    gzFile gz = NULL;
+
+    // Prepare the name for the index file.
+    target_idx = get_index_file(target);
+    if (target_idx == NULL) {
+        return SEEKGZIP_OUTOFMEMORY;
+    }
+
+    // Open the index file for writing.
+    gz = gzopen(target_idx, "wb");
+    free(target_idx);
+    if (gz == NULL) {
+        return SEEKGZIP_OPENERROR;
+    }
+
+    // Write a header.
+    gzwrite(gz, "ZSEK", 4);
+    write_uint32(gz, (uint32_t)sizeof(off_t) | (INDEX_VERSION << 16));
+    write_offset(gz, fpr->size);
+    write_uint32(gz, fpr->head);
+    write_uint32(gz, fpr->tail);
+    write_offset(gz, index->length);
+    write_uint32(gz, (uint32_t)index->have);
+
+    // Write out entry points.
+    for (i = 0;i < index->have;++i) {
+        gzwrite(gz, &index->list[i].out, sizeof(off_t));
+        gzwrite(gz, &index->list[i].in, sizeof(off_t));
+        gzwrite(gz, &index->list[i].bits, sizeof(int));
+        write_uint32(gz, (uint32_t)index->list[i].crc);
+        gzwrite(gz, index->list[i].window, WINSIZE);
+    }
+
+    if (gzclose(gz) != Z_OK) {
+        ret = SEEKGZIP_WRITEERROR;
+    }
+    return ret;
+}
+
 int seekgzip_build(const char *target)
 {
-    int i, len, ret = SEEKGZIP_SUCCESS;
+    int len, ret = SEEKGZIP_SUCCESS;
     FILE *fp = NULL;
     struct access *index = NULL;
-    char *target_idx = NULL;
-    gzFile gz = NULL;
+    struct fingerprint fpr;
 
     // Open the target gzip file.
     fp = fopen(target, "rb");
@@ -444,18 +750,15 @@ int seekgzip_build(const char *target)
     }
 
     // Build an index for the file.
-    len = build_index(fp, SPAN, &index);
+    len = build_index(fp, NULL, SPAN, &index);
     if (len < 0) {
-        switch (len) {
-        case Z_MEM_ERROR:
-            ret = SEEKGZIP_OUTOFMEMORY;
-        case Z_DATA_ERROR:
-            ret = SEEKGZIP_DATAERROR;
-        case Z_ERRNO:
-            ret = SEEKGZIP_READERROR;
-        default:
-            ret = SEEKGZIP_ERROR;
-        }
+        ret = zlib_error(len);
+        goto force_exit;
+    }
+
+    // Take the fingerprint of the file.
+    ret = get_fingerprint(fp, &fpr);
+    if (ret != SEEKGZIP_SUCCESS) {
         goto force_exit;
     }
 
@@ -463,47 +766,83 @@ int seekgzip_build(const char *target)
     fclose(fp);
     fp = NULL;
 
-    // Prepare the name for the index file.
-    target_idx = get_index_file(target);
-    if (target_idx == NULL) {
-        ret = SEEKGZIP_OUTOFMEMORY;
-        goto force_exit;
+    // Write the index file.
+    ret = write_index(target, index, &fpr);
+
+force_exit:
+    if (index != NULL) {
+        free_index(index);
+    }
+    if (fp != NULL) {
+        fclose(fp);
     }
 
-    // Open the index file for writing.
-    gz = gzopen(target_idx, "wb");
-    if (gz == NULL) {
+    return ret;
+}
+
+int seekgzip_build_stream(FILE *in, const char *target)
+{
+    int len, ret = SEEKGZIP_SUCCESS;
+    size_t n;
+    FILE *fp = NULL;
+    struct access *index = NULL;
+    struct tee *tee = NULL;
+    struct fingerprint fpr;
+    unsigned char buffer[CHUNK];
+
+    // Open the target gzip file for writing the data passing through.
+    tee = (struct tee*)malloc(sizeof(struct tee));
+    if (tee == NULL) {
+        return SEEKGZIP_OUTOFMEMORY;
+    }
+    fp = fopen(target, "wb");
+    if (fp == NULL) {
         ret = SEEKGZIP_OPENERROR;
         goto force_exit;
     }
+    tee->fp = fp;
+    tee->size = 0;
+    tee->head = crc32(0L, Z_NULL, 0);
 
-    // Write a header.
-    gzwrite(gz, "ZSEK", 4);
-    write_uint32(gz, (uint32_t)sizeof(off_t));
-    write_uint32(gz, (uint32_t)index->have);
-
-    // Write out entry points.
-    for (i = 0;i < index->have;++i) {
-        gzwrite(gz, &index->list[i].out, sizeof(off_t));
-        gzwrite(gz, &index->list[i].in, sizeof(off_t));
-        gzwrite(gz, &index->list[i].bits, sizeof(int));
-        gzwrite(gz, index->list[i].window, WINSIZE);
+    // Build an index for the data while copying it to the file.
+    len = build_index(in, tee, SPAN, &index);
+    if (len < 0) {
+        ret = (len == Z_ERRNO && ferror(fp)) ? SEEKGZIP_WRITEERROR : zlib_error(len);
+        goto force_exit;
     }
 
-force_exit:
-    if (gz != NULL) {
-        gzclose(gz);
+    // Copy the rest of the input (e.g., following gzip members).
+    while ((n = fread(buffer, 1, CHUNK, in)) != 0) {
+        if (tee_write(tee, buffer, n)) {
+            ret = SEEKGZIP_WRITEERROR;
+            goto force_exit;
+        }
     }
-    if (target_idx != NULL) {
-        free(target_idx);
+    if (ferror(in)) {
+        ret = SEEKGZIP_READERROR;
+        goto force_exit;
     }
+
+    // Close the target file.
+    ret = fclose(fp);
+    fp = NULL;
+    if (ret != 0) {
+        ret = SEEKGZIP_WRITEERROR;
+        goto force_exit;
+    }
+
+    // Write the index file with the fingerprint taken while copying.
+    tee_fingerprint(tee, &fpr);
+    ret = write_index(target, index, &fpr);
+
+force_exit:
     if (index != NULL) {
         free_index(index);
     }
     if (fp != NULL) {
         fclose(fp);
     }
-
+    free(tee);
     return ret;
 }
 
@@ -514,6 +853,7 @@ seekgzip_t* seekgzip_open(const char *target, int *errorcode)
     gzFile gz = NULL;
     char *target_idx = NULL;
     seekgzip_t *zs = NULL;
+    struct fingerprint fpr, actual;
 
     // Open the target gzip file for reading.
     fp = fopen(target, "rb");
@@ -544,12 +884,25 @@ seekgzip_t* seekgzip_open(const char *target, int *errorcode)
     if (gzgetc(gz) != 'K') goto error_exit;
     ret = SEEKGZIP_SUCCESS;
 
-    // Check the size of off_t.
-    if (read_uint32(gz) != sizeof(off_t)) {
+    // Check the size of off_t and the version of the index format.
+    if (read_uint32(gz) != ((uint32_t)sizeof(off_t) | (INDEX_VERSION << 16))) {
         ret = SEEKGZIP_IMCOMPATIBLE;
         goto error_exit;
     }
 
+    // Check that the gzip file has not changed since the index was built.
+    fpr.size = read_offset(gz);
+    fpr.head = read_uint32(gz);
+    fpr.tail = read_uint32(gz);
+    ret = get_fingerprint(fp, &actual);
+    if (ret != SEEKGZIP_SUCCESS) {
+        goto error_exit;
+    }
+    if (fpr.size != actual.size || fpr.head != actual.head || fpr.tail != actual.tail) {
+        ret = SEEKGZIP_STALEINDEX;
+        goto error_exit;
+    }
+
     // Allocate a seekgzip_t instance.
     zs = (seekgzip_t*)malloc(sizeof(seekgzip_t));
     if (zs == NULL) {
@@ -557,8 +910,10 @@ seekgzip_t* seekgzip_open(const char *target, int *errorcode)
         goto error_exit;
     }
     memset(zs, 0, sizeof(*zs));
+    zs->fpr = fpr;
 
-    // Read the number of entry points.
+    // Read the length of the uncompressed data and the number of entry points.
+    zs->index.length = read_offset(gz);
     zs->index.have = zs->index.size = read_uint32(gz);
 
     // Allocate an array for entry points.
@@ -573,14 +928,33 @@ seekgzip_t* seekgzip_open(const char *target, int *errorcode)
         gzread(gz, &zs->index.list[i].out, sizeof(off_t));
         gzread(gz, &zs->index.list[i].in, sizeof(off_t));
         gzread(gz, &zs->index.list[i].bits, sizeof(int));
+        zs->index.list[i].crc = read_uint32(gz);
         gzread(gz, zs->index.list[i].window, WINSIZE);
     }
 
     // Close the index filiiiie.
     if (gzclose(gz) != 0) {
+        gz = NULL;
         ret = SEEKGZIP_ZLIBERROR;
         goto error_exit;
     }
+    gz = NULL;
+
+    // Count the handles sharing the entry points.
+    zs->refcount = (int*)malloc(sizeof(int));
+    if (zs->refcount == NULL) {
+        ret = SEEKGZIP_OUTOFMEMORY;
+        goto error_exit;
+    }
+    *zs->refcount = 1;
+
+    // Keep the name of the gzip file for opening it in other threads.
+    zs->target = (char*)malloc(strlen(target) + 1);
+    if (zs->target == NULL) {
+        ret = SEEKGZIP_OUTOFMEMORY;
+        goto error_exit;
+    }
+    strcpy(zs->target, target);
 
     free(target_idx);
 
@@ -598,6 +972,7 @@ error_exit:
         if (zs->index.list != NULL) {
             free(zs->index.list);
         }
+        free(zs->refcount);
         free(zs);
     }
     if (gz != NULL) {
@@ -616,15 +991,83 @@ error_exit:
     return NULL;
 }
 
+seekgzip_t* seekgzip_dup(seekgzip_t* zs, int *errorcode)
+{
+    int ret = SEEKGZIP_SUCCESS;
+    FILE *fp = NULL;
+    seekgzip_t *dup = NULL;
+    struct fingerprint actual;
+
+    // Open the gzip file again for a file position of the new handle.
+    fp = fopen(zs->target, "rb");
+    if (fp == NULL) {
+        ret = SEEKGZIP_OPENERROR;
+        goto error_exit;
+    }
+
+    // Check that the file is still the one indexed.
+    ret = get_fingerprint(fp, &actual);
+    if (ret != SEEKGZIP_SUCCESS) {
+        goto error_exit;
+    }
+    if (zs->fpr.size != actual.size || zs->fpr.head != actual.head || zs->fpr.tail != actual.tail) {
+        ret = SEEKGZIP_STALEINDEX;
+        goto error_exit;
+    }
+
+    // Allocate a seekgzip_t instance with its own inflate state.
+    dup = (seekgzip_t*)malloc(sizeof(seekgzip_t));
+    if (dup == NULL) {
+        ret = SEEKGZIP_OUTOFMEMORY;
+        goto error_exit;
+    }
+    memset(dup, 0, sizeof(*dup));
+    dup->target = (char*)malloc(strlen(zs->target) + 1);
+    if (dup->target == NULL) {
+        free(dup);
+        ret = SEEKGZIP_OUTOFMEMORY;
+        goto error_exit;
+    }
+    strcpy(dup->target, zs->target);
+
+    // Share the entry points, which are never modified after loaded.
+    dup->fp = fp;
+    dup->fpr = zs->fpr;
+    dup->index = zs->index;
+    dup->refcount = zs->refcount;
+    __sync_add_and_fetch(dup->refcount, 1);
+
+    if (errorcode != NULL) {
+        *errorcode = 0;
+    }
+    return dup;
+
+error_exit:
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    if (errorcode != NULL) {
+        *errorcode = ret;
+    }
+    return NULL;
+}
+
 void seekgzip_close(seekgzip_t* zs)
 {
     if (zs != NULL) {
+        if (zs->active) {
+            (void)inflateEnd(&zs->strm);
+        }
         if (zs->fp != NULL) {
             fclose(zs->fp);
         }
-        if (zs->index.list != NULL) {
-            free(zs->index.list);
+        if (__sync_sub_and_fetch(zs->refcount, 1) == 0) {
+            if (zs->index.list != NULL) {
+                free(zs->index.list);
+            }
+            free(zs->refcount);
         }
+        free(zs->target);
         free(zs);
     }
 }
@@ -639,25 +1082,2050 @@ off_t seekgzip_tell(seekgzip_t *zs)
     return zs->offset;
 }
 
-int seekgzip_read(seekgzip_t* zs, void *buffer, int size)
+/* Read the compressed data at offset in into buf with pread(), which does not
+   disturb the position of the FILE used by extract() and scan(). */
+static int read_input(FILE *fp, off_t in, unsigned char *buf, unsigned size)
 {
-    int len = extract(zs->fp, &zs->index, zs->offset, (unsigned char*)buffer, size);
-    if (0 < len) {
-        zs->offset += len;
-    }
-    return len;
-}
+    ssize_t n;
 
-int seekgzip_error(seekgzip_t* sgz)
-{
-    return sgz->errorcode;
+    do {
+        n = pread(fileno(fp), buf, size, in);
+    } while (n < 0 && errno == EINTR);
+    return (n < 0) ? Z_ERRNO : (int)n;
 }
 
-#ifdef BUILD_UTILITY
-
-static void seekgzip_perror(int ret)
+/* Initialize the inflate state of zs to start at the access point here, as
+   extract() does for every call. */
+static int cursor_start(seekgzip_t* zs, struct point *here)
 {
-    switch (ret) {
+    int ret;
+    unsigned char c;
+
+    if (zs->active) {
+        ret = inflateReset(&zs->strm);
+    } else {
+        zs->strm.zalloc = Z_NULL;
+        zs->strm.zfree = Z_NULL;
+        zs->strm.opaque = Z_NULL;
+        zs->strm.avail_in = 0;
+        zs->strm.next_in = Z_NULL;
+        ret = inflateInit2(&zs->strm, -15);     /* raw inflate */
+        zs->active = (ret == Z_OK);
+    }
+    if (ret != Z_OK)
+        return ret;
+
+    zs->in = here->in;
+    zs->out = here->out;
+    zs->end = 0;
+    zs->strm.avail_in = 0;
+    if (here->bits) {
+        ret = read_input(zs->fp, here->in - 1, &c, 1);
+        if (ret != 1)
+            return (ret < 0) ? ret : Z_DATA_ERROR;
+        (void)inflatePrime(&zs->strm, here->bits, c >> (8 - here->bits));
+    }
+    (void)inflateSetDictionary(&zs->strm, here->window, WINSIZE);
+    return Z_OK;
+}
+
+/* Continue inflating the stream of zs into buf until len bytes are written or
+   the stream ends; return the number of bytes written or a negative error. */
+static int cursor_inflate(seekgzip_t* zs, unsigned char *buf, unsigned len)
+{
+    int ret, n;
+
+    zs->strm.avail_out = len;
+    zs->strm.next_out = buf;
+    while (zs->strm.avail_out != 0 && !zs->end) {
+        if (zs->strm.avail_in == 0) {
+            n = read_input(zs->fp, zs->in, zs->input, CHUNK);
+            if (n <= 0)
+                return (n < 0) ? n : Z_DATA_ERROR;
+            zs->in += n;
+            zs->strm.avail_in = (unsigned)n;
+            zs->strm.next_in = zs->input;
+        }
+        ret = inflate(&zs->strm, Z_NO_FLUSH);       /* normal inflate */
+        if (ret == Z_NEED_DICT)
+            ret = Z_DATA_ERROR;
+        if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
+            return ret;
+        if (ret == Z_STREAM_END)
+            zs->end = 1;
+    }
+    n = (int)(len - zs->strm.avail_out);
+    zs->out += n;
+    return n;
+}
+
+int seekgzip_read(seekgzip_t* zs, void *buffer, int size)
+{
+    int ret;
+    off_t skip;
+    struct point *here;
+    unsigned char discard[WINSIZE];
+
+    /* proceed only if something reasonable to do */
+    if (size <= 0)
+        return 0;
+    here = findpoint(&zs->index, zs->offset);
+    if (here == NULL)
+        return 0;
+
+    /* continue the previous read unless the access point is closer */
+    if (!zs->active || zs->offset < zs->out || zs->out < here->out) {
+        ret = cursor_start(zs, here);
+        if (ret != Z_OK)
+            goto read_error;
+    }
+
+    /* skip uncompressed bytes until offset reached, then satisfy request */
+    while (zs->out < zs->offset) {
+        skip = zs->offset - zs->out;
+        ret = cursor_inflate(zs, discard, skip < WINSIZE ? (unsigned)skip : WINSIZE);
+        if (ret <= 0)
+            goto read_error;
+    }
+    ret = cursor_inflate(zs, (unsigned char*)buffer, (unsigned)size);
+    if (ret < 0)
+        goto read_error;
+    zs->offset += ret;
+    return ret;
+
+  read_error:
+    /* drop the inflate state, which cannot be continued */
+    if (zs->active) {
+        (void)inflateEnd(&zs->strm);
+        zs->active = 0;
+    }
+    if (ret < 0)
+        zs->errorcode = zlib_error(ret);
+    return ret;
+}
+
+int seekgzip_error(seekgzip_t* sgz)
+{
+    return sgz->errorcode;
+}
+
+/* destination of seekgzip_copy_range() */
+struct copy_sink {
+    int fd;                 /* file descriptor to write the data */
+    int ret;                /* error code of writing the data */
+};
+
+static int write_fd(void *instance, off_t offset, const unsigned char *data, unsigned size)
+{
+    ssize_t n;
+    struct copy_sink *sink = (struct copy_sink*)instance;
+
+    while (0 < size) {
+        n = write(sink->fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            sink->ret = SEEKGZIP_WRITEERROR;
+            return 1;
+        }
+        data += n;
+        size -= (unsigned)n;
+    }
+    return 0;
+}
+
+off_t seekgzip_copy_range(seekgzip_t* zs, off_t begin, off_t end, int fd)
+{
+    off_t n;
+    struct point *here;
+    struct copy_sink sink;
+    unsigned char *buf = NULL;
+
+    // Nothing to do for an empty range or a range beyond the end of data.
+    if (end < 0 || zs->index.length < end) {
+        end = zs->index.length;
+    }
+    if (end <= begin) {
+        return 0;
+    }
+    here = findpoint(&zs->index, begin);
+    if (here == NULL) {
+        return 0;
+    }
+
+    buf = (unsigned char*)malloc(COPYCHUNK);
+    if (buf == NULL) {
+        return SEEKGZIP_OUTOFMEMORY;
+    }
+
+    // Inflate the range in one pass and write it directly to the descriptor.
+    sink.fd = fd;
+    sink.ret = SEEKGZIP_SUCCESS;
+    n = scan(zs->fp, here, begin, end - begin, buf, COPYCHUNK, write_fd, &sink);
+    free(buf);
+
+    if (sink.ret != SEEKGZIP_SUCCESS) {
+        return sink.ret;
+    }
+    return (n < 0) ? zlib_error((int)n) : n;
+}
+
+off_t seekgzip_size(seekgzip_t* zs)
+{
+    return zs->index.length;
+}
+
+int seekgzip_info(seekgzip_t* zs, seekgzip_info_t *info)
+{
+    info->version = INDEX_VERSION;
+    info->offset_size = (int)sizeof(off_t);
+    info->compressed_size = zs->fpr.size;
+    info->uncompressed_size = zs->index.length;
+    info->num_points = zs->index.have;
+    info->memory_size = sizeof(seekgzip_t) + sizeof(struct point) * zs->index.size;
+    return SEEKGZIP_SUCCESS;
+}
+
+int seekgzip_get_point(seekgzip_t* zs, int i, seekgzip_point_t *point)
+{
+    if (i < 0 || zs->index.have <= i) {
+        return SEEKGZIP_ERROR;
+    }
+    point->out = zs->index.list[i].out;
+    point->in = zs->index.list[i].in;
+    point->bits = zs->index.list[i].bits;
+    point->crc = (unsigned int)zs->index.list[i].crc;
+    return SEEKGZIP_SUCCESS;
+}
+
+/* position of the first delimiter found by find_delim() */
+struct delim_search {
+    int delim;              /* delimiter character */
+    off_t found;            /* offset just after the delimiter, or -1 */
+};
+
+static int search_delim(void *instance, off_t offset, const unsigned char *data, unsigned size)
+{
+    struct delim_search *ds = (struct delim_search*)instance;
+    const unsigned char *p = (const unsigned char*)memchr(data, ds->delim, size);
+    if (p != NULL) {
+        ds->found = offset + (p - data) + 1;
+        return 1;
+    }
+    return 0;
+}
+
+/* Return the offset of the record that begins at or after offset, i.e., the
+   offset just after the first delimiter at or after offset - 1, the length of
+   the data if there is no such delimiter, or a negative error code. */
+static off_t find_delim(seekgzip_t* zs, off_t offset, int delim, unsigned char *buf)
+{
+    off_t n;
+    struct point *here;
+    struct delim_search ds;
+
+    if (offset <= 0) {
+        return 0;
+    }
+    here = findpoint(&zs->index, offset);
+    if (here == NULL) {
+        return zs->index.length;
+    }
+    ds.delim = delim;
+    ds.found = -1;
+
+    // At an access point, the byte at offset - 1 is the last byte of the
+    // window, which saves decoding the preceding span.  A sparse window
+    // (seekgzip_build_sparse()) may have zeroed the byte, so a zero is not
+    // trusted.
+    if (here->out == offset && here->window[WINSIZE-1] != 0) {
+        if (here->window[WINSIZE-1] == delim) {
+            return offset;
+        }
+        n = scan(zs->fp, here, offset, -1, buf, CHUNK, search_delim, &ds);
+    } else {
+        here = findpoint(&zs->index, offset - 1);
+        n = scan(zs->fp, here, offset - 1, -1, buf, CHUNK, search_delim, &ds);
+    }
+    if (n < 0) {
+        return zlib_error((int)n);
+    }
+    return (ds.found < 0) ? zs->index.length : ds.found;
+}
+
+int seekgzip_splits(seekgzip_t* zs, int num, int delim, seekgzip_range_t *ranges)
+{
+    int k, n = 0;
+    off_t total = zs->index.length, split, target, anchor, pos, prev = 0;
+    struct point *here;
+    unsigned char *buf = NULL;
+
+    if (total <= 0) {
+        return 0;
+    }
+    if (num < 1) {
+        num = 1;
+    }
+    split = total / num;
+
+    buf = (unsigned char*)malloc(CHUNK);
+    if (buf == NULL) {
+        return SEEKGZIP_OUTOFMEMORY;
+    }
+
+    for (k = 1;k < num;++k) {
+        // The ideal boundary of the k-th split.
+        target = split * k + (total % num) * k / num;
+        if (target <= prev) {
+            continue;
+        }
+
+        // Use the nearest access point as the anchor if it is close enough,
+        // which saves discarding the data between the point and the target.
+        anchor = target;
+        here = findpoint(&zs->index, target);
+        if (here != NULL) {
+            if (here + 1 < zs->index.list + zs->index.have &&
+                here[1].out - target < target - here->out) {
+                ++here;
+            }
+            if ((here->out < target ? target - here->out : here->out - target) <= split / 16) {
+                anchor = here->out;
+            }
+        }
+
+        // Align the boundary to the beginning of a record.
+        pos = find_delim(zs, anchor, delim, buf);
+        if (pos < 0) {
+            free(buf);
+            return (int)pos;
+        }
+        if (prev < pos && pos < total) {
+            ranges[n].begin = prev;
+            ranges[n].end = pos;
+            ++n;
+            prev = pos;
+        }
+    }
+
+    ranges[n].begin = prev;
+    ranges[n].end = total;
+    ++n;
+
+    free(buf);
+    return n;
+}
+
+struct tag_seekgzip_reverse
+{
+    seekgzip_t *zs;
+    int delim;
+    int span;               /* number of the spans preceding buffer */
+    off_t base;             /* offset of buffer[0] in the uncompressed data */
+    unsigned char *buffer;  /* decoded data of spans, ending with a partial line */
+    size_t end;             /* end of the data not returned yet in buffer */
+};
+
+/* Prepend the data of the span preceding the buffer to the data not returned
+   yet; each span is decoded only once. */
+static int reverse_fill(seekgzip_reverse_t* rv)
+{
+    int n;
+    off_t len;
+    unsigned char *buffer = NULL;
+    struct point *here = &rv->zs->index.list[rv->span - 1];
+
+    len = rv->base - here->out;
+    buffer = (unsigned char*)malloc((size_t)len + rv->end + 1);
+    if (buffer == NULL) {
+        return SEEKGZIP_OUTOFMEMORY;
+    }
+    n = extract(rv->zs->fp, &rv->zs->index, here->out, buffer, (int)len);
+    if (n != len) {
+        free(buffer);
+        return (n < 0) ? zlib_error(n) : SEEKGZIP_DATAERROR;
+    }
+    if (0 < rv->end) {
+        memcpy(buffer + len, rv->buffer, rv->end);
+    }
+
+    free(rv->buffer);
+    rv->buffer = buffer;
+    rv->end += (size_t)len;
+    rv->base = here->out;
+    rv->span--;
+    return SEEKGZIP_SUCCESS;
+}
+
+seekgzip_reverse_t* seekgzip_reverse_open(seekgzip_t* zs, off_t offset, int delim, int *errorcode)
+{
+    int ret = SEEKGZIP_SUCCESS;
+    seekgzip_reverse_t* rv = NULL;
+
+    rv = (seekgzip_reverse_t*)malloc(sizeof(seekgzip_reverse_t));
+    if (rv == NULL) {
+        ret = SEEKGZIP_OUTOFMEMORY;
+        goto error_exit;
+    }
+    memset(rv, 0, sizeof(*rv));
+    rv->zs = zs;
+    rv->delim = delim;
+
+    // Start from the end of data (exclusive) at offset.
+    if (offset < 0 || zs->index.length < offset) {
+        offset = zs->index.length;
+    }
+    rv->base = offset;
+    if (0 < offset) {
+        // Decode the data from the access point preceding offset.
+        struct point *here = findpoint(&zs->index, offset - 1);
+        rv->span = (int)(here - zs->index.list) + 1;
+        ret = reverse_fill(rv);
+        if (ret != SEEKGZIP_SUCCESS) {
+            goto error_exit;
+        }
+    } else {
+        rv->span = 0;
+    }
+
+    if (errorcode != NULL) {
+        *errorcode = 0;
+    }
+    return rv;
+
+error_exit:
+    seekgzip_reverse_close(rv);
+    if (errorcode != NULL) {
+        *errorcode = ret;
+    }
+    return NULL;
+}
+
+int seekgzip_reverse_readline(seekgzip_reverse_t* rv, const char **line, size_t *size, off_t *offset)
+{
+    int ret;
+    unsigned char *p = NULL;
+
+    for (;;) {
+        // Find the delimiter terminating the previous line; the last byte of
+        // the data may be the delimiter of the line itself.
+        if (0 < rv->end) {
+            p = rv->buffer + rv->end - 1;
+            while (rv->buffer < p && p[-1] != rv->delim) {
+                --p;
+            }
+            if (rv->buffer < p || rv->span == 0) {
+                break;
+            }
+        } else if (rv->span == 0) {
+            return 0;
+        }
+
+        // The line may continue to the preceding span.
+        ret = reverse_fill(rv);
+        if (ret != SEEKGZIP_SUCCESS) {
+            return ret;
+        }
+    }
+
+    *line = (const char*)p;
+    *size = rv->buffer + rv->end - p;
+    if (offset != NULL) {
+        *offset = rv->base + (p - rv->buffer);
+    }
+    rv->end = p - rv->buffer;
+    return 1;
+}
+
+void seekgzip_reverse_close(seekgzip_reverse_t* rv)
+{
+    if (rv != NULL) {
+        free(rv->buffer);
+        free(rv);
+    }
+}
+
+/* decoder of the speculative parallel decompression, defined below */
+struct spec;
+static void spec_finish(struct spec *s);
+
+/* resources of a worker thread, which a task allocates on demand and
+   run_workers() releases */
+struct worker {
+    FILE *fp;               /* gzip file opened by the thread */
+    unsigned char *buf;     /* buffer of the thread */
+    size_t size;            /* size of buf */
+    struct spec *s;         /* decoder of the thread */
+};
+
+/* task for the i-th item of a job; returns zero or an error code */
+typedef int (*worker_task)(void *job, struct worker *w, int i);
+
+/* queue of the items of a job shared by the threads */
+struct workers {
+    worker_task task;       /* task for each item */
+    void *job;              /* job shared by the tasks */
+    int num;                /* number of items */
+    int next;               /* next item to take */
+    int ret;                /* the first error found */
+    pthread_mutex_t mutex;  /* lock for next and ret */
+};
+
+static void *worker_thread(void *arg)
+{
+    int i, ret;
+    struct worker w;
+    struct workers *ws = (struct workers*)arg;
+
+    memset(&w, 0, sizeof(w));
+    for (;;) {
+        // Take the next item unless a task has failed.
+        pthread_mutex_lock(&ws->mutex);
+        i = (ws->ret == 0) ? ws->next++ : ws->num;
+        pthread_mutex_unlock(&ws->mutex);
+        if (ws->num <= i) {
+            break;
+        }
+
+        ret = ws->task(ws->job, &w, i);
+        if (ret != 0) {
+            pthread_mutex_lock(&ws->mutex);
+            if (ws->ret == 0) {
+                ws->ret = ret;
+            }
+            pthread_mutex_unlock(&ws->mutex);
+        }
+    }
+
+    if (w.fp != NULL) {
+        fclose(w.fp);
+    }
+    free(w.buf);
+    if (w.s != NULL) {
+        spec_finish(w.s);
+        free(w.s);
+    }
+    return NULL;
+}
+
+/* Run task for the items 0, ..., num - 1 of job with num_threads threads,
+   including the calling thread, until a task fails; return the first error
+   of the tasks, or zero. */
+static int run_workers(worker_task task, void *job, int num, int num_threads)
+{
+    int i, created = 0;
+    pthread_t *threads = NULL;
+    struct workers ws;
+
+    ws.task = task;
+    ws.job = job;
+    ws.num = num;
+    ws.next = 0;
+    ws.ret = 0;
+    pthread_mutex_init(&ws.mutex, NULL);
+
+    // The calling thread works alone if no other thread starts.
+    if (num < num_threads) {
+        num_threads = num;
+    }
+    if (1 < num_threads) {
+        threads = (pthread_t*)malloc(sizeof(pthread_t) * (num_threads - 1));
+    }
+    for (i = 1;threads != NULL && i < num_threads;++i) {
+        if (pthread_create(&threads[created], NULL, worker_thread, &ws) == 0) {
+            ++created;
+        }
+    }
+    worker_thread(&ws);
+    for (i = 0;i < created;++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&ws.mutex);
+    free(threads);
+    return ws.ret;
+}
+
+/* Open the gzip file of a worker unless it is open. */
+static int worker_open(struct worker *w, const char *target)
+{
+    if (w->fp == NULL) {
+        w->fp = fopen(target, "rb");
+        if (w->fp == NULL) {
+            return SEEKGZIP_OPENERROR;
+        }
+    }
+    return SEEKGZIP_SUCCESS;
+}
+
+/* Make the buffer of a worker at least size bytes. */
+static int worker_reserve(struct worker *w, size_t size)
+{
+    unsigned char *p;
+
+    if (w->size < size) {
+        p = (unsigned char*)realloc(w->buf, size);
+        if (p == NULL) {
+            return SEEKGZIP_OUTOFMEMORY;
+        }
+        w->buf = p;
+        w->size = size;
+    }
+    return SEEKGZIP_SUCCESS;
+}
+
+/* job of verifying the spans of an index */
+struct verify_job {
+    const char *target;     /* name of the gzip file */
+    struct access *index;   /* index to be verified */
+};
+
+static int update_crc(void *instance, off_t offset, const unsigned char *data, unsigned size)
+{
+    uLong *crc = (uLong*)instance;
+    *crc = crc32(*crc, data, size);
+    return 0;
+}
+
+/* Decompress the i-th span and compare its checksum. */
+static int verify_task(void *arg, struct worker *w, int i)
+{
+    int ret;
+    off_t len, n;
+    uLong crc;
+    struct verify_job *job = (struct verify_job*)arg;
+    struct access *index = job->index;
+    struct point *here = &index->list[i];
+
+    // Each thread reads the gzip file with its own file pointer.
+    ret = worker_open(w, job->target);
+    if (ret == SEEKGZIP_SUCCESS) {
+        ret = worker_reserve(w, OUTCHUNK);
+    }
+    if (ret != SEEKGZIP_SUCCESS) {
+        return ret;
+    }
+
+    len = (i + 1 < index->have ? here[1].out : index->length) - here->out;
+    crc = crc32(0L, Z_NULL, 0);
+    n = scan(w->fp, here, here->out, len, w->buf, OUTCHUNK, update_crc, &crc);
+    if (n < 0) {
+        return zlib_error((int)n);
+    } else if (n != len || crc != here->crc) {
+        return SEEKGZIP_DATAERROR;
+    }
+    return SEEKGZIP_SUCCESS;
+}
+
+int seekgzip_verify(seekgzip_t* zs, int num_threads)
+{
+    struct verify_job job;
+
+    // Verify the spans in parallel.
+    job.target = zs->target;
+    job.index = &zs->index;
+    return run_workers(verify_task, &job, zs->index.have, num_threads);
+}
+
+/* draw of a sample: a uniform offset hits a span, and a uniform index picks
+   one of the records ending in the span */
+struct sample_draw {
+    uint64_t seq;               /* order of the draw */
+    int span;                   /* span hit by the offset drawn */
+    uint32_t u;                 /* uniform number for the acceptance */
+    uint32_t v;                 /* uniform number for the index of the record */
+    int crossing;               /* nonzero if the record begins before the span */
+    off_t rank;                 /* index of the record in the span, or -1 */
+    seekgzip_record_t rec;      /* record picked, or empty if rejected */
+};
+
+/* span hit by draws, which is decompressed at most once */
+struct sample_span {
+    int span;                   /* index of the access point of the span */
+    int first;                  /* first of the draws hitting the span */
+    int last;                   /* end of the draws hitting the span */
+    uint64_t seq;               /* order of the first draw hitting the span */
+    off_t size;                 /* size of the span */
+    off_t count;                /* number of records ending in the span, or -1 */
+};
+
+/* job of sampling records */
+struct sample_job {
+    const char *target;         /* name of the gzip file */
+    struct access *index;       /* index of the gzip file */
+    int delim;                  /* delimiter of records */
+    struct sample_draw *draws;  /* draws sorted by the spans hit */
+    struct sample_span *spans;  /* spans hit by the draws */
+    const int *todo;            /* spans to be decompressed */
+    double density;             /* highest density of records found so far */
+};
+
+#define SAMPLELIMIT 16      /* maximum number of draws per sample */
+
+/* Return a pseudo-random number (xorshift64*). */
+static uint64_t sample_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/* Accept a draw with the probability of the density of records in its span
+   divided by the highest density; spans are hit in proportion to their
+   sizes, so the records accepted are uniform over the records. */
+static int sample_accept(const struct sample_draw *d, const struct sample_span *s, double density)
+{
+    return 0 < s->count &&
+        (double)d->u * density * (double)s->size < (double)s->count * 4294967296.0;
+}
+
+static int compare_draw_span(const void *x, const void *y)
+{
+    const struct sample_draw *a = (const struct sample_draw*)x;
+    const struct sample_draw *b = (const struct sample_draw*)y;
+    if (a->span != b->span) {
+        return (a->span < b->span) ? -1 : 1;
+    }
+    return (a->seq < b->seq) ? -1 : (b->seq < a->seq);
+}
+
+static int compare_draw_rank(const void *x, const void *y)
+{
+    const struct sample_draw *a = (const struct sample_draw*)x;
+    const struct sample_draw *b = (const struct sample_draw*)y;
+    return (a->rank < b->rank) ? -1 : (b->rank < a->rank);
+}
+
+static int compare_draw_offset(const void *x, const void *y)
+{
+    const struct sample_draw *a = *(const struct sample_draw* const*)x;
+    const struct sample_draw *b = *(const struct sample_draw* const*)y;
+    if (a->rec.offset != b->rec.offset) {
+        return (a->rec.offset < b->rec.offset) ? -1 : 1;
+    }
+    return (a->seq < b->seq) ? -1 : (b->seq < a->seq);
+}
+
+static int compare_draw_seq(const void *x, const void *y)
+{
+    const struct sample_draw *a = *(const struct sample_draw* const*)x;
+    const struct sample_draw *b = *(const struct sample_draw* const*)y;
+    return (a->seq < b->seq) ? -1 : (b->seq < a->seq);
+}
+
+/* Decompress a span hit, count the records ending in it, and take the records
+   of all the draws hitting it that are not rejected yet, so that the span is
+   never decompressed again. */
+static int sample_task(void *arg, struct worker *w, int t)
+{
+    int i, ret;
+    off_t n, count = 0;
+    size_t size, begin = 0, end = 0;
+    const unsigned char *p;
+    struct sample_job *job = (struct sample_job*)arg;
+    struct sample_span *s = &job->spans[job->todo[t]];
+    struct sample_draw *d;
+    struct point *here = &job->index->list[s->span];
+
+    // Each thread reads the gzip file with its own file pointer.
+    ret = worker_open(w, job->target);
+    if (ret == SEEKGZIP_SUCCESS) {
+        ret = worker_reserve(w, (size_t)s->size);
+    }
+    if (ret != SEEKGZIP_SUCCESS) {
+        return ret;
+    }
+    size = (size_t)s->size;
+    n = extract(w->fp, job->index, here->out, w->buf, (int)size);
+    if (n != s->size) {
+        return (n < 0) ? zlib_error((int)n) : SEEKGZIP_DATAERROR;
+    }
+
+    // A record belongs to the span of its delimiter; the last record of the
+    // data may have no delimiter.
+    for (p = w->buf;(p = (const unsigned char*)memchr(p, job->delim, size - (p - w->buf))) != NULL;++p) {
+        ++count;
+    }
+    if (s->span + 1 == job->index->have && w->buf[size-1] != job->delim) {
+        ++count;
+    }
+    s->count = count;
+
+    // Pick the records of the draws by their indexes in increasing order.
+    for (i = s->first;i < s->last;++i) {
+        d = &job->draws[i];
+        d->rank = sample_accept(d, s, job->density) ?
+            (off_t)(((uint64_t)d->v * (uint64_t)count) >> 32) : -1;
+    }
+    qsort(job->draws + s->first, s->last - s->first, sizeof(struct sample_draw), compare_draw_rank);
+    for (i = s->first, n = 0;i < s->last;++i) {
+        d = &job->draws[i];
+        if (d->rank < 0) {
+            continue;
+        }
+        for (;n <= d->rank;++n) {
+            begin = end;
+            p = (const unsigned char*)memchr(w->buf + end, job->delim, size - end);
+            end = (p != NULL) ? (size_t)(p - w->buf) + 1 : size;
+        }
+
+        d->rec.data = (char*)malloc(end - begin + 1);
+        if (d->rec.data == NULL) {
+            return SEEKGZIP_OUTOFMEMORY;
+        }
+        memcpy(d->rec.data, w->buf + begin, end - begin);
+        d->rec.data[end - begin] = 0;
+        d->rec.offset = here->out + (off_t)begin;
+        d->rec.size = end - begin;
+
+        // The first record may begin in the preceding spans unless the last
+        // byte of the window is the delimiter (a zero is not trusted).
+        d->crossing = (begin == 0 && 0 < s->span &&
+                       (job->delim == 0 || here->window[WINSIZE-1] != job->delim));
+    }
+    return SEEKGZIP_SUCCESS;
+}
+
+/* Prepend the beginning of a record crossing the boundary of its span, which
+   is read backwards from the boundary. */
+static int sample_crossing(seekgzip_t* zs, seekgzip_record_t *rec, int delim)
+{
+    int ret = SEEKGZIP_SUCCESS;
+    size_t size = 0;
+    const char *line = NULL;
+    char *data = NULL;
+    off_t begin = rec->offset;
+    seekgzip_reverse_t* rv = NULL;
+
+    rv = seekgzip_reverse_open(zs, rec->offset, delim, &ret);
+    if (rv == NULL) {
+        return ret;
+    }
+    ret = seekgzip_reverse_readline(rv, &line, &size, &begin);
+    if (ret == 1 && line[size-1] != delim) {
+        data = (char*)malloc(size + rec->size + 1);
+        if (data == NULL) {
+            ret = SEEKGZIP_OUTOFMEMORY;
+        } else {
+            memcpy(data, line, size);
+            memcpy(data + size, rec->data, rec->size + 1);
+            free(rec->data);
+            rec->data = data;
+            rec->offset = begin;
+            rec->size += size;
+        }
+    }
+    seekgzip_reverse_close(rv);
+    return (ret < 0) ? ret : SEEKGZIP_SUCCESS;
+}
+
+int seekgzip_sample(seekgzip_t* zs, int num, unsigned int seed, int delim, int num_threads, seekgzip_record_t *records)
+{
+    int i, j, k = 0, m, n, num_spans = 0, drawn, ret = SEEKGZIP_SUCCESS;
+    int *todo = NULL;
+    uint64_t state, r;
+    double density = 0., more;
+    struct point *here;
+    struct sample_draw *draws = NULL, **accepted = NULL;
+    struct sample_span *spans = NULL, *s;
+    struct sample_job job;
+
+    if (num <= 0 || zs->index.length <= 0) {
+        return 0;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    memset(records, 0, sizeof(seekgzip_record_t) * num);
+    n = (num < 0x7FFFFFFF / SAMPLELIMIT) ? num * SAMPLELIMIT : 0x7FFFFFFF;
+    draws = (struct sample_draw*)calloc(n, sizeof(struct sample_draw));
+    accepted = (struct sample_draw**)malloc(sizeof(struct sample_draw*) * n);
+    spans = (struct sample_span*)malloc(sizeof(struct sample_span) * n);
+    todo = (int*)malloc(sizeof(int) * n);
+    if (draws == NULL || accepted == NULL || spans == NULL || todo == NULL) {
+        ret = SEEKGZIP_OUTOFMEMORY;
+        goto sample_exit;
+    }
+
+    // Draw all the offsets beforehand, so that a span hit is decompressed
+    // once for all the draws hitting it, including those in later rounds.
+    state = ((uint64_t)seed << 32) ^ 0x9E3779B97F4A7C15ULL;
+    for (i = 0;i < n;++i) {
+        here = findpoint(&zs->index, (off_t)(sample_random(&state) % (uint64_t)zs->index.length));
+        r = sample_random(&state);
+        draws[i].seq = (uint64_t)i;
+        draws[i].span = (int)(here - zs->index.list);
+        draws[i].u = (uint32_t)(r >> 32);
+        draws[i].v = (uint32_t)r;
+    }
+    qsort(draws, n, sizeof(struct sample_draw), compare_draw_span);
+    for (i = 0;i < n;++i) {
+        if (i == 0 || draws[i].span != draws[i-1].span) {
+            s = &spans[num_spans++];
+            here = &zs->index.list[draws[i].span];
+            s->span = draws[i].span;
+            s->first = i;
+            s->seq = draws[i].seq;
+            s->size = (s->span + 1 < zs->index.have ? here[1].out : zs->index.length) - here->out;
+            s->count = -1;
+        }
+        spans[num_spans-1].last = i + 1;
+    }
+
+    job.target = zs->target;
+    job.index = &zs->index;
+    job.delim = delim;
+    job.draws = draws;
+    job.spans = spans;
+    job.todo = todo;
+
+    // Take the draws in rounds until num distinct records are accepted.
+    for (drawn = num + num / 4 + 16;;) {
+        if (n < drawn) {
+            drawn = n;
+        }
+
+        // Decompress the spans newly hit by the draws in parallel.
+        for (i = 0, m = 0;i < num_spans;++i) {
+            if (spans[i].count < 0 && spans[i].seq < (uint64_t)drawn) {
+                todo[m++] = i;
+            }
+        }
+        job.density = density;
+        ret = run_workers(sample_task, &job, m, num_threads);
+        if (ret != SEEKGZIP_SUCCESS) {
+            goto sample_exit;
+        }
+        for (i = 0;i < num_spans;++i) {
+            if (0 < spans[i].count &&
+                density * (double)spans[i].size < (double)spans[i].count) {
+                density = (double)spans[i].count / (double)spans[i].size;
+            }
+        }
+
+        // Drop the records rejected against the highest density found, which
+        // never decreases, so a rejected draw is never accepted later.
+        for (i = 0, m = 0;i < num_spans;++i) {
+            for (j = spans[i].first;j < spans[i].last;++j) {
+                if (draws[j].rec.data == NULL) {
+                    continue;
+                } else if (!sample_accept(&draws[j], &spans[i], density)) {
+                    free(draws[j].rec.data);
+                    draws[j].rec.data = NULL;
+                } else if (draws[j].seq < (uint64_t)drawn) {
+                    accepted[m++] = &draws[j];
+                }
+            }
+        }
+
+        // Keep the first draw of each record accepted.
+        qsort(accepted, m, sizeof(struct sample_draw*), compare_draw_offset);
+        for (i = 0, k = 0;i < m;++i) {
+            if (k == 0 || accepted[i]->rec.offset != accepted[k-1]->rec.offset) {
+                accepted[k++] = accepted[i];
+            }
+        }
+        if (num <= k || n <= drawn) {
+            break;
+        }
+
+        // Take as many as expected to accept the rest from the rate so far.
+        more = (double)(num - k) * (double)drawn / (double)(k ? k : 1) * 1.25 + 16;
+        drawn = (more < (double)(n - drawn)) ? drawn + (int)more : n;
+    }
+
+    // Accepted draws are uniform over records; the first num distinct
+    // records in the order of the draws are a sample without replacement.
+    qsort(accepted, k, sizeof(struct sample_draw*), compare_draw_seq);
+    if (num < k) {
+        k = num;
+    }
+    qsort(accepted, k, sizeof(struct sample_draw*), compare_draw_offset);
+    for (i = 0;i < k;++i) {
+        if (accepted[i]->crossing) {
+            ret = sample_crossing(zs, &accepted[i]->rec, delim);
+            if (ret != SEEKGZIP_SUCCESS) {
+                goto sample_exit;
+            }
+        }
+    }
+    for (i = 0;i < k;++i) {
+        records[i] = accepted[i]->rec;
+        accepted[i]->rec.data = NULL;
+    }
+
+sample_exit:
+    if (draws != NULL) {
+        for (i = 0;i < n;++i) {
+            free(draws[i].rec.data);
+        }
+    }
+    free(todo);
+    free(spans);
+    free(accepted);
+    free(draws);
+    return (ret == SEEKGZIP_SUCCESS) ? k : ret;
+}
+
+void seekgzip_free_records(seekgzip_record_t *records, int num)
+{
+    int i;
+    for (i = 0;i < num;++i) {
+        free(records[i].data);
+        records[i].data = NULL;
+    }
+}
+
+/*===== Speculative parallel decompression =====*/
+
+/* A gzip stream without an index can only be inflated from its beginning,
+   because inflate needs the 32K bytes of uncompressed data preceding any point
+   of the stream.  The functions below decode a single-member gzip stream in
+   parallel in the way of pugz: the compressed data is divided into chunks,
+   and a thread decodes each chunk from the first position in the chunk that
+   looks like the beginning of a dynamic block.  The thread does not know the
+   32K window preceding the position, so a back-reference into the window is
+   decoded into a marker that refers to the position in the window.  The
+   chunks are then stitched in order: the markers in a chunk are resolved
+   when the window at the end of the previous chunk is known, and a chunk is
+   decoded again from the true position if the previous chunk did not end at
+   the position where the guess started.  The decoder records every block
+   boundary, from which access points are created as build_index() does. */
+
+#define PCHUNK 4194304      /* size of compressed data decoded by a thread */
+#define PMINCHUNK 65536     /* minimum size of compressed data for a thread */
+#define PMAXOUT 8388608     /* output of a chunk after which it ends at a block */
+#define FASTBITS 10         /* number of bits in the primary decoding table */
+#define MAXBITS 15          /* maximum bits in a code */
+#define SPARSELIMIT (8 * SPAN)  /* data decoded to find the references to a window */
+
+/* bit reader over the compressed data in memory */
+struct bits {
+    const unsigned char *data;  /* compressed data */
+    size_t size;        /* size of the compressed data */
+    size_t next;        /* next byte to load into buf */
+    uint64_t buf;       /* bit buffer */
+    int cnt;            /* number of bits in buf */
+    int overrun;        /* nonzero if reading past the end of data */
+};
+
+static void bits_fill(struct bits *bs)
+{
+    while (bs->cnt <= 56 && bs->next < bs->size) {
+        bs->buf |= (uint64_t)bs->data[bs->next++] << bs->cnt;
+        bs->cnt += 8;
+    }
+}
+
+static unsigned bits_peek(struct bits *bs, int n)
+{
+    if (bs->cnt < n)
+        bits_fill(bs);
+    return (unsigned)(bs->buf & (((uint64_t)1 << n) - 1));
+}
+
+static void bits_drop(struct bits *bs, int n)
+{
+    if (bs->cnt < n) {
+        bs->overrun = 1;
+        bs->buf = 0;
+        bs->cnt = 0;
+    } else {
+        bs->buf >>= n;
+        bs->cnt -= n;
+    }
+}
+
+static unsigned bits_get(struct bits *bs, int n)
+{
+    unsigned v = bits_peek(bs, n);
+    bits_drop(bs, n);
+    return v;
+}
+
+static void bits_init(struct bits *bs, const unsigned char *data, size_t size, uint64_t pos)
+{
+    bs->data = data;
+    bs->size = size;
+    bs->next = (size_t)(pos >> 3);
+    bs->buf = 0;
+    bs->cnt = 0;
+    bs->overrun = (size < bs->next);
+    bits_fill(bs);
+    bits_drop(bs, (int)(pos & 7));
+}
+
+static uint64_t bits_tell(const struct bits *bs)
+{
+    return ((uint64_t)bs->next << 3) - bs->cnt;
+}
+
+/* canonical Huffman decoding table, with a primary table indexed by the next
+   fastbits bits of input for short codes (as puff.c decodes the others) */
+struct huffman {
+    int fastbits;               /* number of bits indexing fast */
+    uint16_t fast[1 << FASTBITS];   /* symbol << 4 | length, or 0 */
+    short count[MAXBITS+1];     /* number of symbols of each length */
+    short symbol[288];          /* symbols ordered by length and value */
+};
+
+/* Build a decoding table from the code lengths.  Return zero for a complete
+   code, a negative value for an over-subscribed code, or a positive value for
+   an incomplete code, as construct() of puff.c does. */
+static int huffman_build(struct huffman *h, const unsigned char *length, int n, int fastbits)
+{
+    int i, k, len, left, symbol, code, rev, fill;
+    short offs[MAXBITS+1];
+
+    for (len = 0;len <= MAXBITS;++len)
+        h->count[len] = 0;
+    for (symbol = 0;symbol < n;++symbol)
+        h->count[length[symbol]]++;
+    h->fastbits = fastbits;
+    memset(h->fast, 0, sizeof(h->fast[0]) << fastbits);
+    if (h->count[0] == n)               /* no codes: complete, but decode fails */
+        return 0;
+
+    /* check for an over-subscribed or incomplete set of lengths */
+    left = 1;
+    for (len = 1;len <= MAXBITS;++len) {
+        left <<= 1;
+        left -= h->count[len];
+        if (left < 0)
+            return left;
+    }
+
+    /* sort symbols by length, by symbol order within each length */
+    offs[1] = 0;
+    for (len = 1;len < MAXBITS;++len)
+        offs[len + 1] = offs[len] + h->count[len];
+    for (symbol = 0;symbol < n;++symbol)
+        if (length[symbol] != 0)
+            h->symbol[offs[length[symbol]]++] = (short)symbol;
+
+    /* fill the primary table with the codes of at most fastbits bits, whose
+       bits are reversed since deflate packs codes from the most significant */
+    code = k = 0;
+    for (len = 1;len <= fastbits;++len) {
+        for (i = 0;i < h->count[len];++i, ++k, ++code) {
+            for (rev = 0, fill = 0;fill < len;++fill)
+                rev |= ((code >> fill) & 1) << (len - 1 - fill);
+            for (fill = rev;fill < (1 << fastbits);fill += 1 << len)
+                h->fast[fill] = (uint16_t)((h->symbol[k] << 4) | len);
+        }
+        code <<= 1;
+    }
+    return left;
+}
+
+/* Decode a symbol, or return -1 for an invalid code. */
+static int huffman_decode(struct bits *bs, const struct huffman *h)
+{
+    int len, code, first, index, count;
+    unsigned v = bits_peek(bs, MAXBITS);
+    unsigned entry = h->fast[v & ((1U << h->fastbits) - 1)];
+
+    if (entry) {
+        bits_drop(bs, entry & 15);
+        return (int)(entry >> 4);
+    }
+
+    /* decode a long code bit by bit as decode() of puff.c does */
+    code = first = index = 0;
+    for (len = 1;len <= MAXBITS;++len) {
+        code |= (v >> (len - 1)) & 1;
+        count = h->count[len];
+        if (code - count < first) {
+            bits_drop(bs, len);
+            return h->symbol[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+/* block boundary found by the decoder */
+struct boundary {
+    uint64_t pos;       /* bit position of the block header */
+    size_t out;         /* number of symbols decoded before the block */
+};
+
+/* decoder of deflate blocks with an unknown window: a symbol in out is a
+   byte (< 256), or a marker 256 + i referring to window[i] of the unknown
+   32K window preceding the first block */
+struct spec {
+    struct bits bs;             /* input */
+    uint64_t start;             /* bit position of the first block */
+    uint64_t end;               /* bit position after the last block */
+    int final;                  /* nonzero if the last block was decoded */
+    uint16_t *out;              /* decoded symbols */
+    size_t have, size;          /* number of symbols filled and allocated */
+    struct boundary *bounds;    /* block boundaries */
+    int nbounds, maxbounds;     /* number of boundaries filled and allocated */
+    struct huffman lencode, distcode, fixedlen, fixeddist;
+};
+
+static const short lbase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const short lext[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const short dbase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577};
+static const short dext[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11,
+    12, 12, 13, 13};
+
+static void spec_init(struct spec *s)
+{
+    int symbol;
+    unsigned char lengths[288];
+
+    memset(s, 0, sizeof(*s));
+    for (symbol = 0;symbol < 144;++symbol)
+        lengths[symbol] = 8;
+    for (;symbol < 256;++symbol)
+        lengths[symbol] = 9;
+    for (;symbol < 280;++symbol)
+        lengths[symbol] = 7;
+    for (;symbol < 288;++symbol)
+        lengths[symbol] = 8;
+    huffman_build(&s->fixedlen, lengths, 288, FASTBITS);
+    for (symbol = 0;symbol < 30;++symbol)
+        lengths[symbol] = 5;
+    huffman_build(&s->fixeddist, lengths, 30, FASTBITS);
+}
+
+static void spec_finish(struct spec *s)
+{
+    free(s->out);
+    free(s->bounds);
+}
+
+/* Make room for n more symbols; return nonzero if out of memory. */
+static int spec_reserve(struct spec *s, size_t n)
+{
+    size_t size;
+    uint16_t *out;
+
+    if (s->have + n <= s->size)
+        return 0;
+    size = s->size ? s->size : PCHUNK;
+    while (size < s->have + n)
+        size <<= 1;
+    out = (uint16_t*)realloc(s->out, sizeof(uint16_t) * size);
+    if (out == NULL)
+        return 1;
+    s->out = out;
+    s->size = size;
+    return 0;
+}
+
+/* Read the code lengths of a dynamic block and build the decoding tables;
+   return nonzero unless they are valid, which tells most random positions
+   from the headers of dynamic blocks. */
+static int spec_dynamic(struct bits *bs, struct huffman *lencode, struct huffman *distcode)
+{
+    static const short order[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    int nlen, ndist, ncode, index, symbol, len, err;
+    unsigned char lengths[286+30];
+
+    nlen = bits_get(bs, 5) + 257;
+    ndist = bits_get(bs, 5) + 1;
+    ncode = bits_get(bs, 4) + 4;
+    if (nlen > 286 || ndist > 30)
+        return -1;
+
+    /* the code length code must be complete */
+    for (index = 0;index < ncode;++index)
+        lengths[order[index]] = (unsigned char)bits_get(bs, 3);
+    for (;index < 19;++index)
+        lengths[order[index]] = 0;
+    if (huffman_build(distcode, lengths, 19, 7) != 0)
+        return -1;
+
+    /* read the literal/length and distance code lengths */
+    index = 0;
+    while (index < nlen + ndist) {
+        symbol = huffman_decode(bs, distcode);
+        if (symbol < 0 || bs->overrun)
+            return -1;
+        if (symbol < 16) {
+            lengths[index++] = (unsigned char)symbol;
+        } else {
+            len = 0;
+            if (symbol == 16) {
+                if (index == 0)
+                    return -1;
+                len = lengths[index - 1];
+                symbol = 3 + bits_get(bs, 2);
+            } else if (symbol == 17) {
+                symbol = 3 + bits_get(bs, 3);
+            } else {
+                symbol = 11 + bits_get(bs, 7);
+            }
+            if (index + symbol > nlen + ndist)
+                return -1;
+            while (symbol--)
+                lengths[index++] = (unsigned char)len;
+        }
+    }
+
+    /* an end-of-block code is required; incomplete codes are allowed only
+       for a single code (as zlib and puff.c do) */
+    if (lengths[256] == 0)
+        return -1;
+    err = huffman_build(lencode, lengths, nlen, FASTBITS);
+    if (err < 0 || (0 < err && nlen - lencode->count[0] != 1))
+        return -1;
+    err = huffman_build(distcode, lengths + nlen, ndist, FASTBITS);
+    if (err < 0 || (0 < err && ndist - distcode->count[0] != 1))
+        return -1;
+    return bs->overrun;
+}
+
+/* Decode the symbols of a fixed or dynamic block. */
+static int spec_codes(struct spec *s, const struct huffman *lencode, const struct huffman *distcode)
+{
+    int symbol;
+    unsigned i, len, dist;
+    struct bits *bs = &s->bs;
+    uint16_t *to;
+
+    for (;;) {
+        if (spec_reserve(s, 258))
+            return Z_MEM_ERROR;
+        symbol = huffman_decode(bs, lencode);
+        if (symbol < 256) {
+            if (symbol < 0)
+                return Z_DATA_ERROR;
+            s->out[s->have++] = (uint16_t)symbol;
+            continue;
+        }
+        if (symbol == 256)
+            return bs->overrun ? Z_DATA_ERROR : Z_OK;
+
+        /* length and distance of a back-reference */
+        symbol -= 257;
+        if (29 <= symbol)
+            return Z_DATA_ERROR;
+        len = lbase[symbol] + bits_get(bs, lext[symbol]);
+        symbol = huffman_decode(bs, distcode);
+        if (symbol < 0 || 30 <= symbol)
+            return Z_DATA_ERROR;
+        dist = dbase[symbol] + bits_get(bs, dext[symbol]);
+        if (bs->overrun || s->have + WINSIZE < dist)
+            return Z_DATA_ERROR;
+
+        /* copy, making markers for the bytes in the unknown window */
+        to = s->out + s->have;
+        if (dist <= s->have) {
+            for (i = 0;i < len;++i)
+                to[i] = to[(long)i - (long)dist];
+        } else {
+            for (i = 0;i < len;++i)
+                to[i] = (i < dist - s->have) ?
+                    (uint16_t)(256 + WINSIZE - (dist - s->have) + i) :
+                    to[(long)i - (long)dist];
+        }
+        s->have += len;
+    }
+}
+
+/* Decode a stored block. */
+static int spec_stored(struct spec *s)
+{
+    unsigned len, nlen;
+    struct bits *bs = &s->bs;
+
+    bits_drop(bs, bs->cnt & 7);         /* go to a byte boundary */
+    len = bits_get(bs, 16);
+    nlen = bits_get(bs, 16);
+    if (len != (~nlen & 0xffff) || bs->overrun)
+        return Z_DATA_ERROR;
+    if (spec_reserve(s, len))
+        return Z_MEM_ERROR;
+    while (len--)
+        s->out[s->have++] = (uint16_t)bits_get(bs, 8);
+    return bs->overrun ? Z_DATA_ERROR : Z_OK;
+}
+
+/* Decode a block at the current position, setting *last to BFINAL. */
+static int spec_block(struct spec *s, int *last)
+{
+    *last = bits_get(&s->bs, 1);
+    switch (bits_get(&s->bs, 2)) {
+    case 0:
+        return spec_stored(s);
+    case 1:
+        return spec_codes(s, &s->fixedlen, &s->fixeddist);
+    case 2:
+        return spec_dynamic(&s->bs, &s->lencode, &s->distcode) ?
+            Z_DATA_ERROR : spec_codes(s, &s->lencode, &s->distcode);
+    default:
+        return Z_DATA_ERROR;
+    }
+}
+
+/* Decode blocks from the current position to the end of the stream, until a
+   non-final dynamic block that starts at or after the bit position stop, or
+   until a block boundary after PMAXOUT symbols, recording the block
+   boundaries. */
+static int spec_inflate(struct spec *s, uint64_t stop)
+{
+    int ret, last;
+    uint64_t pos;
+    struct boundary *bounds;
+
+    s->have = 0;
+    s->nbounds = 0;
+    s->final = 0;
+    for (;;) {
+        pos = bits_tell(&s->bs);
+        if (stop <= pos && bits_peek(&s->bs, 3) == 4)
+            break;
+        if (PMAXOUT <= s->have)
+            break;
+
+        /* record the block boundary */
+        if (s->nbounds == s->maxbounds) {
+            s->maxbounds = s->maxbounds ? s->maxbounds << 1 : 64;
+            bounds = (struct boundary*)realloc(s->bounds, sizeof(struct boundary) * s->maxbounds);
+            if (bounds == NULL)
+                return Z_MEM_ERROR;
+            s->bounds = bounds;
+        }
+        s->bounds[s->nbounds].pos = pos;
+        s->bounds[s->nbounds].out = s->have;
+        s->nbounds++;
+
+        /* decode the block */
+        ret = spec_block(s, &last);
+        if (ret != Z_OK)
+            return ret;
+        if (last) {
+            s->final = 1;
+            break;
+        }
+    }
+    s->end = bits_tell(&s->bs);
+    return Z_OK;
+}
+
+/* Decode from the first position in [from, to) that starts a non-final
+   dynamic block and decodes without errors until stop. */
+static int spec_guess(struct spec *s, const unsigned char *data, size_t size,
+                      uint64_t from, uint64_t to, uint64_t stop)
+{
+    int ret;
+    uint32_t word;
+    uint64_t pos;
+    size_t i;
+
+    for (pos = from;pos < to;++pos) {
+        /* test BFINAL = 0, BTYPE = 2, HLIT <= 29 and HDIST <= 29 cheaply */
+        i = (size_t)(pos >> 3);
+        if (size <= i + 3)
+            break;
+        word = (uint32_t)data[i] | ((uint32_t)data[i+1] << 8) |
+            ((uint32_t)data[i+2] << 16) | ((uint32_t)data[i+3] << 24);
+        word >>= pos & 7;
+        if ((word & 7) != 4 || 29 < ((word >> 3) & 31) || 29 < ((word >> 8) & 31))
+            continue;
+
+        /* test the code lengths, then try to decode the chunk */
+        bits_init(&s->bs, data, size, pos + 3);
+        if (spec_dynamic(&s->bs, &s->lencode, &s->distcode))
+            continue;
+        bits_init(&s->bs, data, size, pos);
+        ret = spec_inflate(s, stop);
+        if (ret == Z_MEM_ERROR)
+            return ret;
+        if (ret == Z_OK) {
+            s->start = pos;
+            return Z_OK;
+        }
+    }
+    return Z_DATA_ERROR;
+}
+
+/* chunk of the compressed data decoded by a thread */
+struct spec_chunk {
+    uint64_t from;      /* known position of the first block, or the beginning of the chunk */
+    uint64_t to;        /* end of the chunk (guessing only) */
+    uint64_t stop;      /* position where the decoding stops */
+    int known;          /* nonzero if from is a known block boundary */
+    int ret;            /* result of decoding */
+    struct spec s;      /* decoder and its output */
+};
+
+/* job of decoding the chunks of a batch */
+struct spec_job {
+    const unsigned char *data;  /* compressed data */
+    size_t size;                /* size of the compressed data */
+    struct spec_chunk *chunks;  /* chunks of the batch */
+};
+
+/* Decode the i-th chunk, keeping the result in the chunk. */
+static int spec_task(void *arg, struct worker *w, int i)
+{
+    struct spec_job *job = (struct spec_job*)arg;
+    struct spec_chunk *c = &job->chunks[i];
+
+    if (c->known) {
+        bits_init(&c->s.bs, job->data, job->size, c->from);
+        c->s.start = c->from;
+        c->ret = spec_inflate(&c->s, c->stop);
+    } else {
+        c->ret = spec_guess(&c->s, job->data, job->size, c->from, c->to, c->stop);
+    }
+    return 0;
+}
+
+/* state of stitching the decoded chunks in order */
+struct stitch {
+    unsigned char window[WINSIZE];  /* last 32K of uncompressed data */
+    unsigned char base[WINSIZE];    /* window preceding the chunk, for markers */
+    unsigned char out[COPYCHUNK];   /* resolved data of a piece of a chunk */
+    off_t totout;               /* total uncompressed data */
+    uLong check;                /* CRC-32 of all uncompressed data */
+    uLong crc;                  /* CRC-32 of the current span */
+    off_t last;                 /* totout value of last access point */
+    struct access *index;       /* access points being generated, or NULL */
+    int build;                  /* nonzero to generate access points */
+    struct copy_sink sink;      /* destination of uncompressed data, fd < 0 if none */
+};
+
+/* Update a CRC-32 with data that may be longer than uInt. */
+static uLong crc32_large(uLong crc, const unsigned char *buf, size_t len)
+{
+    uInt n;
+
+    while (0 < len) {
+        n = (len < 0x40000000) ? (uInt)len : 0x40000000;
+        crc = crc32(crc, buf, n);
+        buf += n;
+        len -= n;
+    }
+    return crc;
+}
+
+/* Resolve the markers of a chunk with the preceding window, create access
+   points at its block boundaries, and write the data to the destination.  The
+   chunk is resolved in pieces of COPYCHUNK so that the data of the whole
+   chunk is never held as bytes. */
+static int stitch_chunk(struct stitch *st, const struct spec *s)
+{
+    int i = 0, bits;
+    size_t j, k, m, done;
+    uint16_t sym;
+    off_t out;
+    unsigned char *p, *buf = st->out;
+    unsigned char tmp[WINSIZE];
+
+    /* markers refer to the window preceding the chunk */
+    memcpy(st->base, st->window, WINSIZE);
+
+    for (j = 0;j < s->have || (j == 0 && i < s->nbounds);j += m) {
+        m = (s->have - j < COPYCHUNK) ? s->have - j : COPYCHUNK;
+
+        /* resolve the markers; a marker must not refer to before the stream */
+        for (k = 0;k < m;++k) {
+            sym = s->out[j + k];
+            if (sym < 256) {
+                buf[k] = (unsigned char)sym;
+            } else {
+                sym -= 256;
+                if (sym + st->totout < WINSIZE)
+                    return Z_DATA_ERROR;
+                buf[k] = st->base[sym];
+            }
+        }
+
+        /* add access points at the block boundaries in the piece (or at its
+           end for the last piece) as build_index() does */
+        done = 0;
+        for (;st->build && i < s->nbounds;++i) {
+            k = s->bounds[i].out - j;
+            if (m < k || (k == m && j + m < s->have))
+                break;
+            out = st->totout + (off_t)k;
+            st->crc = crc32_large(st->crc, buf + done, k - done);
+            done = k;
+            if (out == 0 || out - st->last > SPAN) {
+                if (st->index != NULL) {
+                    st->index->list[st->index->have - 1].crc = st->crc;
+                    st->crc = crc32(0L, Z_NULL, 0);
+                }
+
+                /* make the 32K window preceding the point */
+                if (WINSIZE <= k) {
+                    p = buf + k - WINSIZE;
+                } else {
+                    memcpy(tmp, st->window + k, WINSIZE - k);
+                    memcpy(tmp + WINSIZE - k, buf, k);
+                    p = tmp;
+                }
+
+                bits = (int)(s->bounds[i].pos & 7);
+                st->index = addpoint(st->index, bits ? 8 - bits : 0,
+                                     (off_t)((s->bounds[i].pos + 7) >> 3), out, 0, p);
+                if (st->index == NULL)
+                    return Z_MEM_ERROR;
+                st->last = out;
+            }
+        }
+        if (st->build)
+            st->crc = crc32_large(st->crc, buf + done, m - done);
+        st->check = crc32_large(st->check, buf, m);
+
+        /* write out the data */
+        if (0 <= st->sink.fd && 0 < m && write_fd(&st->sink, 0, buf, (unsigned)m))
+            return Z_ERRNO;
+
+        /* slide the window */
+        if (WINSIZE <= m) {
+            memcpy(st->window, buf + m - WINSIZE, WINSIZE);
+        } else {
+            memmove(st->window, st->window + m, WINSIZE - m);
+            memcpy(st->window + WINSIZE - m, buf, m);
+        }
+        st->totout += (off_t)m;
+        if (m == 0)
+            break;
+    }
+    return Z_OK;
+}
+
+/* Return the size of the gzip header at data, or 0 if it is not gzip. */
+static size_t gzip_header(const unsigned char *data, size_t size)
+{
+    int flags;
+    size_t pos = 10;
+
+    if (size < 18 || data[0] != 0x1f || data[1] != 0x8b || data[2] != 8)
+        return 0;
+    flags = data[3];
+    if (flags & 4) {                    /* FEXTRA */
+        if (size < pos + 2)
+            return 0;
+        pos += 2 + (data[pos] | (data[pos+1] << 8));
+    }
+    if (flags & 8) {                    /* FNAME */
+        while (pos < size && data[pos] != 0)
+            ++pos;
+        ++pos;
+    }
+    if (flags & 16) {                   /* FCOMMENT */
+        while (pos < size && data[pos] != 0)
+            ++pos;
+        ++pos;
+    }
+    if (flags & 2)                      /* FHCRC */
+        pos += 2;
+    return (pos < size) ? pos : 0;
+}
+
+/* Decompress the first gzip member in data with num_threads threads, writing
+   the data to fd (unless fd is negative) and building an index in *built
+   (unless built is NULL), and set *used to the size of the member (unless
+   used is NULL).  Return Z_OK, or Z_DATA_ERROR, Z_MEM_ERROR, Z_ERRNO (for a
+   write error), or Z_VERSION_ERROR if data is not a gzip stream. */
+static int parallel_inflate(const unsigned char *data, size_t size, int num_threads,
+                            int fd, struct access **built, size_t *used)
+{
+    int i, n, ret = Z_OK, capped = 0, final = 0;
+    size_t header, trailer, region, chunk = PCHUNK;
+    uint64_t pos, begin;
+    off_t totout;
+    struct spec_chunk *chunks = NULL;
+    struct stitch *st = NULL;
+    struct spec_job job;
+    struct point *next;
+
+    header = gzip_header(data, size);
+    if (header == 0)
+        return Z_VERSION_ERROR;
+    if (num_threads < 1)
+        num_threads = 1;
+
+    chunks = (struct spec_chunk*)calloc(num_threads, sizeof(struct spec_chunk));
+    st = (struct stitch*)calloc(1, sizeof(struct stitch));
+    if (chunks == NULL || st == NULL) {
+        free(st);
+        free(chunks);
+        return Z_MEM_ERROR;
+    }
+    for (i = 0;i < num_threads;++i)
+        spec_init(&chunks[i].s);
+    st->check = crc32(0L, Z_NULL, 0);
+    st->crc = crc32(0L, Z_NULL, 0);
+    st->build = (built != NULL);
+    st->sink.fd = fd;
+    st->sink.ret = SEEKGZIP_SUCCESS;
+
+    job.data = data;
+    job.size = size;
+    job.chunks = chunks;
+
+    /* decode batches of chunks until the end of the deflate stream */
+    pos = (uint64_t)header << 3;
+    while (!final) {
+        region = (size_t)(pos >> 3);
+        if (size <= region) {
+            ret = Z_DATA_ERROR;         /* the stream is truncated */
+            break;
+        }
+
+        /* the first chunk starts from the known position; guess the others */
+        for (n = 0;n < num_threads;++n) {
+            struct spec_chunk *c = &chunks[n];
+            c->from = (n == 0) ? pos : (uint64_t)(region + n * chunk) << 3;
+            c->to = (uint64_t)(region + (n + 1) * chunk) << 3;
+            c->stop = c->to;
+            c->known = (n == 0);
+            if ((uint64_t)size << 3 <= c->to)
+                c->stop = (uint64_t)-1;
+            if (c->stop == (uint64_t)-1) {
+                ++n;
+                break;
+            }
+        }
+
+        run_workers(spec_task, &job, n, num_threads);
+
+        /* stitch the chunks, decoding again from the true position if the
+           guess was wrong; after a chunk ended early at PMAXOUT, the next
+           batch starts from the true position instead */
+        begin = pos;
+        totout = st->totout;
+        for (i = 0;i < n;++i) {
+            struct spec_chunk *c = &chunks[i];
+            if (!c->known && (c->ret != Z_OK || c->s.start != pos)) {
+                if (capped)
+                    break;
+                bits_init(&c->s.bs, data, size, pos);
+                c->s.start = pos;
+                c->ret = spec_inflate(&c->s, c->stop);
+            }
+            if (c->ret != Z_OK) {
+                ret = c->ret;
+                goto parallel_exit;
+            }
+            ret = stitch_chunk(st, &c->s);
+            if (ret != Z_OK)
+                goto parallel_exit;
+            pos = c->s.end;
+            final = c->s.final;
+            capped = !final && PMAXOUT <= c->s.have;
+            if (final)
+                break;
+        }
+
+        /* size the chunks so that a chunk decodes about PMAXOUT / 2 of data
+           at the compression ratio so far */
+        if (totout < st->totout) {
+            chunk = (size_t)((double)(PMAXOUT / 2) * (double)((pos - begin) >> 3) /
+                             (double)(st->totout - totout));
+            chunk = (chunk < PMINCHUNK) ? PMINCHUNK : (PCHUNK < chunk ? PCHUNK : chunk);
+        }
+    }
+
+    /* check the gzip trailer */
+    if (ret == Z_OK) {
+        trailer = (size_t)((pos + 7) >> 3);
+        if (size < trailer + 8 ||
+            (uint32_t)st->check != ((uint32_t)data[trailer] | ((uint32_t)data[trailer+1] << 8) |
+                ((uint32_t)data[trailer+2] << 16) | ((uint32_t)data[trailer+3] << 24)) ||
+            (uint32_t)st->totout != ((uint32_t)data[trailer+4] | ((uint32_t)data[trailer+5] << 8) |
+                ((uint32_t)data[trailer+6] << 16) | ((uint32_t)data[trailer+7] << 24))) {
+            ret = Z_DATA_ERROR;
+        }
+    }
+
+    if (ret == Z_OK && used != NULL)
+        *used = trailer + 8;
+
+    /* finish the index (release unused entries in list) */
+    if (ret == Z_OK && built != NULL) {
+        st->index->list[st->index->have - 1].crc = st->crc;
+        st->index->length = st->totout;
+        next = (struct point*)realloc(st->index->list, sizeof(struct point) * st->index->have);
+        if (next != NULL)
+            st->index->list = next;
+        st->index->size = st->index->have;
+        *built = st->index;
+        st->index = NULL;
+    }
+
+  parallel_exit:
+    for (i = 0;i < num_threads;++i)
+        spec_finish(&chunks[i].s);
+    if (st->index != NULL)
+        free_index(st->index);
+    free(st);
+    free(chunks);
+    return ret;
+}
+
+/* Map the gzip file into memory. */
+static int map_file(FILE *fp, const unsigned char **data, size_t *size)
+{
+    struct stat st;
+    void *p;
+
+    if (fstat(fileno(fp), &st) != 0 || st.st_size <= 0) {
+        return SEEKGZIP_READERROR;
+    }
+    p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (p == MAP_FAILED) {
+        return SEEKGZIP_READERROR;
+    }
+    *data = (const unsigned char*)p;
+    *size = (size_t)st.st_size;
+    return SEEKGZIP_SUCCESS;
+}
+
+/* Mark in used the bytes of the window of the access point here that the data
+   decoded from here refers to, directly or through copies of them.  Decoding
+   stops when the last 32K of the data refers to none of them, or at the end
+   of the stream; return Z_BUF_ERROR if it does not stop within SPARSELIMIT
+   bytes of the data. */
+static int sparse_point(struct spec *s, const unsigned char *data, size_t size,
+                        const struct point *here, unsigned char *used)
+{
+    int ret, last;
+    size_t j, live = 0;
+
+    memset(used, 0, WINSIZE);
+    bits_init(&s->bs, data, size, ((uint64_t)here->in << 3) - here->bits);
+    s->have = 0;
+    do {
+        j = s->have;
+        ret = spec_block(s, &last);
+        if (ret != Z_OK)
+            return ret;
+        for (;j < s->have;++j) {
+            if (256 <= s->out[j]) {
+                used[s->out[j] - 256] = 1;
+                live = j + 1;
+            }
+        }
+        if (live + WINSIZE <= s->have)
+            return Z_OK;
+    } while (!last && s->have <= SPARSELIMIT);
+    return last ? Z_OK : Z_BUF_ERROR;
+}
+
+/* job of making the windows of the access points sparse */
+struct sparse_job {
+    const unsigned char *data;  /* compressed data */
+    size_t size;                /* size of the compressed data */
+    struct access *index;       /* access points */
+};
+
+/* Zero the bytes of the window of the i-th point that no data refers to;
+   keep the whole window if the references reach too far. */
+static int sparse_task(void *arg, struct worker *w, int i)
+{
+    int ret;
+    unsigned j;
+    struct point *here;
+    struct sparse_job *job = (struct sparse_job*)arg;
+
+    // Each thread decodes with its own decoder, and marks in its buffer.
+    if (w->s == NULL) {
+        w->s = (struct spec*)malloc(sizeof(struct spec));
+        if (w->s == NULL) {
+            return Z_MEM_ERROR;
+        }
+        spec_init(w->s);
+    }
+    if (worker_reserve(w, WINSIZE) != SEEKGZIP_SUCCESS) {
+        return Z_MEM_ERROR;
+    }
+
+    here = &job->index->list[i];
+    ret = sparse_point(w->s, job->data, job->size, here, w->buf);
+    if (ret == Z_OK) {
+        for (j = 0;j < WINSIZE;++j) {
+            if (!w->buf[j]) {
+                here->window[j] = 0;
+            }
+        }
+    }
+    return (ret == Z_BUF_ERROR) ? Z_OK : ret;
+}
+
+/* Zero the bytes of the windows of the access points that the compressed
+   data following them never refers to, using num_threads threads.  The
+   data decoded from each point does not change, while the zeroed windows
+   compress well in the index file. */
+static int sparse_index(const unsigned char *data, size_t size, struct access *index, int num_threads)
+{
+    struct sparse_job job;
+
+    job.data = data;
+    job.size = size;
+    job.index = index;
+    return run_workers(sparse_task, &job, index->have, num_threads);
+}
+
+int seekgzip_build_parallel(const char *target, int num_threads)
+{
+    int ret = SEEKGZIP_SUCCESS;
+    FILE *fp = NULL;
+    const unsigned char *data = NULL;
+    size_t size = 0;
+    struct access *index = NULL;
+    struct fingerprint fpr;
+
+    // Open the target gzip file and map it into memory.
+    fp = fopen(target, "rb");
+    if (fp == NULL) {
+        return SEEKGZIP_OPENERROR;
+    }
+    ret = map_file(fp, &data, &size);
+    if (ret != SEEKGZIP_SUCCESS) {
+        goto force_exit;
+    }
+
+    // Build an index for the file, or fall back to build_index() unless gzip.
+    ret = parallel_inflate(data, size, num_threads, -1, &index, NULL);
+    if (ret == Z_VERSION_ERROR) {
+        munmap((void*)data, size);
+        fclose(fp);
+        return seekgzip_build(target);
+    }
+    if (ret != Z_OK) {
+        ret = zlib_error(ret);
+        goto force_exit;
+    }
+
+    // Take the fingerprint of the file, and write the index file.
+    ret = get_fingerprint(fp, &fpr);
+    if (ret == SEEKGZIP_SUCCESS) {
+        ret = write_index(target, index, &fpr);
+    }
+
+force_exit:
+    if (index != NULL) {
+        free_index(index);
+    }
+    if (data != NULL) {
+        munmap((void*)data, size);
+    }
+    fclose(fp);
+    return ret;
+}
+
+int seekgzip_build_sparse(const char *target, int num_threads)
+{
+    int ret = SEEKGZIP_SUCCESS;
+    FILE *fp = NULL;
+    const unsigned char *data = NULL;
+    size_t size = 0;
+    struct access *index = NULL;
+    struct fingerprint fpr;
+
+    // Open the target gzip file and map it into memory.
+    fp = fopen(target, "rb");
+    if (fp == NULL) {
+        return SEEKGZIP_OPENERROR;
+    }
+    ret = map_file(fp, &data, &size);
+    if (ret != SEEKGZIP_SUCCESS) {
+        goto force_exit;
+    }
+
+    // Build an index for the file as seekgzip_build_parallel() does.
+    ret = (1 < num_threads) ?
+        parallel_inflate(data, size, num_threads, -1, &index, NULL) : Z_VERSION_ERROR;
+    if (ret == Z_VERSION_ERROR) {
+        ret = build_index(fp, NULL, SPAN, &index);
+        ret = (ret < 0) ? ret : Z_OK;
+    }
+    if (ret != Z_OK) {
+        ret = zlib_error(ret);
+        goto force_exit;
+    }
+
+    // Keep only the bytes of the windows that the data refers to.
+    ret = sparse_index(data, size, index, num_threads);
+    if (ret != Z_OK) {
+        ret = zlib_error(ret);
+        goto force_exit;
+    }
+
+    // Take the fingerprint of the file, and write the index file.
+    ret = get_fingerprint(fp, &fpr);
+    if (ret == SEEKGZIP_SUCCESS) {
+        ret = write_index(target, index, &fpr);
+    }
+
+force_exit:
+    if (index != NULL) {
+        free_index(index);
+    }
+    if (data != NULL) {
+        munmap((void*)data, size);
+    }
+    fclose(fp);
+    return ret;
+}
+
+int seekgzip_decompress(const char *target, int fd, int num_threads)
+{
+    int ret = SEEKGZIP_SUCCESS;
+    FILE *fp = NULL;
+    const unsigned char *data = NULL;
+    size_t size = 0, offset, used = 0;
+
+    // Open the target gzip file and map it into memory.
+    fp = fopen(target, "rb");
+    if (fp == NULL) {
+        return SEEKGZIP_OPENERROR;
+    }
+    ret = map_file(fp, &data, &size);
+    if (ret == SEEKGZIP_SUCCESS) {
+        // Decompress the gzip members one after another; data other than a
+        // gzip member after the first one is an error.
+        for (offset = 0;offset < size;offset += used) {
+            ret = parallel_inflate(data + offset, size - offset, num_threads, fd, NULL, &used);
+            if (ret == Z_VERSION_ERROR) {
+                ret = (offset == 0) ? SEEKGZIP_IMCOMPATIBLE : SEEKGZIP_DATAERROR;
+                break;
+            } else if (ret == Z_ERRNO) {
+                ret = SEEKGZIP_WRITEERROR;
+                break;
+            } else if (ret != Z_OK) {
+                ret = zlib_error(ret);
+                break;
+            }
+        }
+        munmap((void*)data, size);
+    }
+    fclose(fp);
+    return ret;
+}
+
+#ifdef BUILD_UTILITY
+
+#include <time.h>
+
+static void seekgzip_perror(int ret)
+{
+    switch (ret) {
     case SEEKGZIP_ERROR:
         fprintf(stderr, "ERROR: An unknown error occurred.\n");
         break;
@@ -682,84 +3150,487 @@ static void seekgzip_perror(int ret)
     case SEEKGZIP_ZLIBERROR:
         fprintf(stderr, "ERROR: An error occurred in zlib.\n");
         break;
+    case SEEKGZIP_STALEINDEX:
+        fprintf(stderr, "ERROR: The index file is out of date; rebuild it.\n");
+        break;
     }
 }
 
-int main(int argc, char *argv[])
+static void usage(const char *argv0)
 {
-    int ret = 0;
-
-    if (argc != 3) {
-        printf("This utility manages an index for random (seekable) access to a gzip file.\n");
-        printf("USAGE:\n");
-        printf("    %s -b <FILE>\n", argv[0]);
-        printf("        Build an index file \"$FILE.idx\" for the gzip file $FILE.\n");
-        printf("    %s <FILE> [BEGIN-END]\n", argv[0]);
-        printf("        Output the content of the gzip file $FILE of offset range [BEGIN:END).\n");
-        return 0;
+    printf("This utility manages an index for random (seekable) access to a gzip file.\n");
+    printf("USAGE:\n");
+    printf("    %s -b [-j N] [--sparse] <FILE>\n", argv0);
+    printf("        Build an index file \"$FILE.idx\" for the gzip file $FILE using N threads.\n");
+    printf("        With --sparse, store only the bytes of the windows that the data refers to.\n");
+    printf("    %s -b -o <OUT> <FILE>\n", argv0);
+    printf("        Copy the gzip file $FILE (STDIN if $FILE is \"-\") to $OUT, building \"$OUT.idx\".\n");
+    printf("        This build is serial and not sparse; -j and --sparse are not allowed.\n");
+    printf("    %s -d [-j N] <FILE>\n", argv0);
+    printf("        Decompress the gzip file $FILE to STDOUT using N threads.\n");
+    printf("    %s --verify [-j N] <FILE>\n", argv0);
+    printf("        Verify the gzip file $FILE against its index using N threads.\n");
+    printf("    %s --splits N <FILE>\n", argv0);
+    printf("    %s --split-size SIZE <FILE>\n", argv0);
+    printf("        Plan N (or SIZE-byte) ranges of $FILE aligned to line boundaries.\n");
+    printf("    %s -i [--json] <FILE>\n", argv0);
+    printf("        Inspect the index of $FILE and estimate the cost of a random seek.\n");
+    printf("    %s --tail N <FILE>\n", argv0);
+    printf("        Output the last N lines of the gzip file $FILE.\n");
+    printf("    %s --sample K [--seed S] [-j N] <FILE>\n", argv0);
+    printf("        Output K distinct lines of $FILE sampled uniformly using N threads.\n");
+    printf("    %s <FILE> [BEGIN-END]\n", argv0);
+    printf("        Output the content of the gzip file $FILE of offset range [BEGIN:END).\n");
+}
 
-    } else if (strcmp(argv[1], "-b") == 0) {
-        const char *target = argv[2];
+static int build_main(const char *target, int num_threads, int sparse)
+{
+    int ret;
 
-        printf("Building an index: %s.idx\n", target);
-        printf("Filesize up to: %d bit\n", (int)sizeof(off_t) * 8);
+    printf("Building an index: %s.idx\n", target);
+    printf("Filesize up to: %d bit\n", (int)sizeof(off_t) * 8);
 
+    if (sparse) {
+        ret = seekgzip_build_sparse(target, num_threads);
+    } else if (1 < num_threads) {
+        ret = seekgzip_build_parallel(target, num_threads);
+    } else {
         ret = seekgzip_build(target);
-        if (ret != 0) {
-            seekgzip_perror(ret);
+    }
+    if (ret != 0) {
+        seekgzip_perror(ret);
+        return 1;
+    }
+    return 0;
+}
+
+static int build_stream_main(const char *source, const char *target)
+{
+    int ret;
+    FILE *fp = stdin;
+
+    if (strcmp(source, "-") != 0) {
+        fp = fopen(source, "rb");
+        if (fp == NULL) {
+            seekgzip_perror(SEEKGZIP_OPENERROR);
             return 1;
         }
-        return 0;
+    }
 
-    } else {
-        char *arg = argv[2], *p = NULL;
-        off_t begin = 0, end = (off_t)-1;
-        seekgzip_t* zs = seekgzip_open(argv[1], NULL);
-        if (zs == NULL) {
-            fprintf(stderr, "ERROR: Failed to open the index file.\n");
-            return 1;
+    printf("Building an index: %s.idx\n", target);
+    printf("Filesize up to: %d bit\n", (int)sizeof(off_t) * 8);
+
+    ret = seekgzip_build_stream(fp, target);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    if (ret != 0) {
+        seekgzip_perror(ret);
+        return 1;
+    }
+    return 0;
+}
+
+static int decompress_main(const char *target, int num_threads)
+{
+    int ret;
+
+    fflush(stdout);
+    ret = seekgzip_decompress(target, fileno(stdout), num_threads);
+    if (ret != 0) {
+        seekgzip_perror(ret);
+        return 1;
+    }
+    return 0;
+}
+
+static int verify_main(const char *target, int num_threads)
+{
+    int ret = 0;
+    seekgzip_t* zs = seekgzip_open(target, &ret);
+    if (zs == NULL) {
+        seekgzip_perror(ret);
+        return 1;
+    }
+
+    ret = seekgzip_verify(zs, num_threads);
+    seekgzip_close(zs);
+    if (ret != 0) {
+        seekgzip_perror(ret);
+        return 1;
+    }
+    printf("OK: %s\n", target);
+    return 0;
+}
+
+static int splits_main(const char *target, int num, off_t size)
+{
+    int i, n, ret = 0;
+    seekgzip_range_t *ranges = NULL;
+    seekgzip_t* zs = seekgzip_open(target, &ret);
+    if (zs == NULL) {
+        seekgzip_perror(ret);
+        return 1;
+    }
+
+    // Convert the split size into the number of splits.
+    if (0 < size) {
+        num = (int)((seekgzip_size(zs) + size - 1) / size);
+    }
+    if (num < 1) {
+        num = 1;
+    }
+
+    ranges = (seekgzip_range_t*)malloc(sizeof(seekgzip_range_t) * num);
+    if (ranges == NULL) {
+        seekgzip_perror(SEEKGZIP_OUTOFMEMORY);
+        seekgzip_close(zs);
+        return 1;
+    }
+
+    n = seekgzip_splits(zs, num, '\n', ranges);
+    if (n < 0) {
+        seekgzip_perror(n);
+        ret = 1;
+    }
+    for (i = 0;i < n;++i) {
+        printf("%lld-%lld\n", (long long)ranges[i].begin, (long long)ranges[i].end);
+    }
+
+    free(ranges);
+    seekgzip_close(zs);
+    return ret;
+}
+
+/* Return the number of bytes discarded by a random seek at the quantile p,
+   assuming that the offset of a seek is distributed uniformly.  An offset in
+   a span of size L discards x bytes (0 <= x < L) with the same probability,
+   and sizes is the list of the span sizes sorted in ascending order. */
+static int compare_offset(const void *x, const void *y)
+{
+    off_t a = *(const off_t*)x, b = *(const off_t*)y;
+    return (a < b) ? -1 : (b < a);
+}
+
+static off_t discard_quantile(const off_t *sizes, int n, off_t total, double p)
+{
+    int j;
+    double below = 0., target = p * (double)total;
+
+    for (j = 0;j < n;++j) {
+        // P(discard <= x) * total = below + x * (n - j) for x in the j-th interval.
+        if (target <= below + (double)sizes[j] * (n - j)) {
+            return (off_t)((target - below) / (n - j));
         }
+        below += (double)sizes[j];
+    }
+    return (0 < n) ? sizes[n-1] : 0;
+}
 
-        p = strchr(arg, '-');
-        if (p == NULL) {
-            begin =(off_t)strtoull(arg, NULL, 10);
-            end = begin+1;
-        } else if (p == arg) {
-            begin = 0;
-            end = (off_t)strtoull(p+1, NULL, 10);
-        } else if (p == arg + strlen(arg) - 1) {
-            *p = 0;
-            begin = (off_t)strtoull(arg, NULL, 10);
+static void print_json_string(const char *str)
+{
+    putchar('"');
+    for (;*str;++str) {
+        if (*str == '"' || *str == '\\') {
+            printf("\\%c", *str);
+        } else if ((unsigned char)*str < 0x20) {
+            printf("\\u%04x", (unsigned char)*str);
         } else {
-            *p++ = 0;
-            begin =(off_t)strtoull(arg, NULL, 10);
-            end =(off_t)strtoull(p, NULL, 10);
+            putchar(*str);
         }
+    }
+    putchar('"');
+}
 
-        seekgzip_seek(zs, begin);
+static int inspect_main(const char *target, int json)
+{
+    int i, n, ret = 0;
+    long long idx_size = -1;
+    double mean = 0.;
+    off_t *usizes = NULL, *csizes = NULL, *sorted = NULL;
+    off_t total, q50, q90, q99;
+    char *target_idx = NULL;
+    struct stat st;
+    seekgzip_info_t info;
+    seekgzip_point_t *points = NULL;
+    seekgzip_t* zs = seekgzip_open(target, &ret);
+    if (zs == NULL) {
+        seekgzip_perror(ret);
+        return 1;
+    }
 
-        while (begin < end) {
-            int read;
-            char buffer[CHUNK];
-            off_t size = (end - begin);
-            if (CHUNK < size) {
-                size = CHUNK;
-            }
-            read = seekgzip_read(zs, buffer, (int)size);
-            if (0 < read) {
-                fwrite(buffer, read, sizeof(char), stdout);
-                begin += read;
-            } else if (read == 0) {
-                break;
-            } else {
-                fprintf(stderr, "ERROR: An error occurred while reading the gzip file.\n");
-                ret = 1;
-                break;
-            }
+    seekgzip_info(zs, &info);
+    n = info.num_points;
+    total = info.uncompressed_size;
+
+    // Obtain the size of the index file.
+    target_idx = get_index_file(target);
+    if (target_idx != NULL && stat(target_idx, &st) == 0) {
+        idx_size = (long long)st.st_size;
+    }
+
+    // Compute the uncompressed and compressed sizes of the spans.
+    points = (seekgzip_point_t*)malloc(sizeof(seekgzip_point_t) * (n + 1));
+    usizes = (off_t*)malloc(sizeof(off_t) * (n + 1));
+    csizes = (off_t*)malloc(sizeof(off_t) * (n + 1));
+    sorted = (off_t*)malloc(sizeof(off_t) * (n + 1));
+    if (points == NULL || usizes == NULL || csizes == NULL || sorted == NULL) {
+        seekgzip_perror(SEEKGZIP_OUTOFMEMORY);
+        ret = 1;
+        goto inspect_exit;
+    }
+    for (i = 0;i < n;++i) {
+        seekgzip_get_point(zs, i, &points[i]);
+    }
+    for (i = 0;i < n;++i) {
+        usizes[i] = ((i + 1 < n) ? points[i+1].out : total) - points[i].out;
+        csizes[i] = ((i + 1 < n) ? points[i+1].in : info.compressed_size) - points[i].in;
+        sorted[i] = usizes[i];
+        mean += (double)usizes[i] * (double)usizes[i];
+    }
+
+    // Model the distribution of the bytes discarded by a random seek.
+    qsort(sorted, n, sizeof(off_t), compare_offset);
+    mean = (0 < total) ? mean / (2. * (double)total) : 0.;
+    q50 = discard_quantile(sorted, n, total, 0.50);
+    q90 = discard_quantile(sorted, n, total, 0.90);
+    q99 = discard_quantile(sorted, n, total, 0.99);
+
+    if (json) {
+        printf("{\n");
+        printf("  \"file\": ");
+        print_json_string(target);
+        printf(",\n");
+        printf("  \"version\": %d,\n", info.version);
+        printf("  \"offset_bits\": %d,\n", info.offset_size * 8);
+        printf("  \"compressed_size\": %lld,\n", (long long)info.compressed_size);
+        printf("  \"uncompressed_size\": %lld,\n", (long long)total);
+        printf("  \"num_points\": %d,\n", n);
+        printf("  \"memory_size\": %lld,\n", (long long)info.memory_size);
+        printf("  \"disk_size\": %lld,\n", idx_size);
+        printf("  \"seek_discard\": {\"mean\": %.0f, \"median\": %lld, \"p90\": %lld, \"p99\": %lld, \"max\": %lld},\n",
+            mean, (long long)q50, (long long)q90, (long long)q99, (long long)(0 < n ? sorted[n-1] : 0));
+        printf("  \"spans\": [\n");
+        for (i = 0;i < n;++i) {
+            printf("    {\"out\": %lld, \"in\": %lld, \"bits\": %d, \"uncompressed\": %lld, \"compressed\": %lld}%s\n",
+                (long long)points[i].out, (long long)points[i].in, points[i].bits,
+                (long long)usizes[i], (long long)csizes[i], (i + 1 < n) ? "," : "");
+        }
+        printf("  ]\n");
+        printf("}\n");
+    } else {
+        printf("Index file: %s.idx\n", target);
+        printf("Format version: %d\n", info.version);
+        printf("Filesize up to: %d bit\n", info.offset_size * 8);
+        printf("Compressed size: %lld\n", (long long)info.compressed_size);
+        printf("Uncompressed size: %lld\n", (long long)total);
+        printf("Access points: %d\n", n);
+        printf("Index size: %lld bytes in memory, %lld bytes on disk\n", (long long)info.memory_size, idx_size);
+        printf("Bytes discarded per random seek: mean %.0f, median %lld, 90%% %lld, 99%% %lld, max %lld\n",
+            mean, (long long)q50, (long long)q90, (long long)q99, (long long)(0 < n ? sorted[n-1] : 0));
+        printf("\n");
+        printf("%8s %16s %16s %4s %12s %12s %7s\n", "#", "OUT", "IN", "BITS", "UNCOMPRESSED", "COMPRESSED", "RATIO");
+        for (i = 0;i < n;++i) {
+            printf("%8d %16lld %16lld %4d %12lld %12lld %7.3f\n",
+                i, (long long)points[i].out, (long long)points[i].in, points[i].bits,
+                (long long)usizes[i], (long long)csizes[i],
+                (0 < csizes[i]) ? (double)usizes[i] / (double)csizes[i] : 0.);
         }
-    
+    }
+
+inspect_exit:
+    free(sorted);
+    free(csizes);
+    free(usizes);
+    free(points);
+    free(target_idx);
+    seekgzip_close(zs);
+    return ret;
+}
+
+static int tail_main(const char *target, int num)
+{
+    int i, ret = 0;
+    size_t size;
+    const char *line = NULL;
+    off_t begin, end;
+    seekgzip_reverse_t* rv = NULL;
+    seekgzip_t* zs = seekgzip_open(target, &ret);
+    if (zs == NULL) {
+        seekgzip_perror(ret);
+        return 1;
+    }
+
+    // Walk back N lines from the end to find where the last N lines begin.
+    end = begin = seekgzip_size(zs);
+    rv = seekgzip_reverse_open(zs, end, '\n', &ret);
+    if (rv == NULL) {
+        seekgzip_perror(ret);
         seekgzip_close(zs);
-        return ret;
+        return 1;
+    }
+    for (i = 0;i < num;++i) {
+        ret = seekgzip_reverse_readline(rv, &line, &size, &begin);
+        if (ret <= 0) {
+            break;
+        }
+    }
+    seekgzip_reverse_close(rv);
+
+    if (ret < 0) {
+        seekgzip_perror(ret);
+        ret = 1;
+    } else {
+        fflush(stdout);
+        ret = (seekgzip_copy_range(zs, begin, end, fileno(stdout)) < 0);
+        if (ret) {
+            fprintf(stderr, "ERROR: An error occurred while reading the gzip file.\n");
+        }
+    }
+
+    seekgzip_close(zs);
+    return ret;
+}
+
+static int sample_main(const char *target, int num, unsigned int seed, int num_threads)
+{
+    int i, n, ret = 0;
+    seekgzip_record_t *records = NULL;
+    seekgzip_t* zs = seekgzip_open(target, &ret);
+    if (zs == NULL) {
+        seekgzip_perror(ret);
+        return 1;
+    }
+
+    records = (seekgzip_record_t*)malloc(sizeof(seekgzip_record_t) * num);
+    if (records == NULL) {
+        seekgzip_perror(SEEKGZIP_OUTOFMEMORY);
+        seekgzip_close(zs);
+        return 1;
+    }
+
+    n = seekgzip_sample(zs, num, seed, '\n', num_threads, records);
+    if (n < 0) {
+        seekgzip_perror(n);
+        ret = 1;
+    }
+    for (i = 0;i < n;++i) {
+        fwrite(records[i].data, sizeof(char), records[i].size, stdout);
+        if (records[i].size == 0 || records[i].data[records[i].size-1] != '\n') {
+            putchar('\n');
+        }
+    }
+
+    if (0 < n) {
+        seekgzip_free_records(records, n);
+    }
+    free(records);
+    seekgzip_close(zs);
+    return ret;
+}
+
+static int read_main(const char *target, char *arg)
+{
+    int ret = 0;
+    char *p = NULL;
+    off_t begin = 0, end = (off_t)-1;
+    seekgzip_t* zs = seekgzip_open(target, &ret);
+    if (zs == NULL) {
+        seekgzip_perror(ret);
+        return 1;
+    }
+
+    p = strchr(arg, '-');
+    if (p == NULL) {
+        begin =(off_t)strtoull(arg, NULL, 10);
+        end = begin+1;
+    } else if (p == arg) {
+        begin = 0;
+        end = (off_t)strtoull(p+1, NULL, 10);
+    } else if (p == arg + strlen(arg) - 1) {
+        *p = 0;
+        begin = (off_t)strtoull(arg, NULL, 10);
+    } else {
+        *p++ = 0;
+        begin =(off_t)strtoull(arg, NULL, 10);
+        end =(off_t)strtoull(p, NULL, 10);
+    }
+
+    fflush(stdout);
+    if (seekgzip_copy_range(zs, begin, end, fileno(stdout)) < 0) {
+        fprintf(stderr, "ERROR: An error occurred while reading the gzip file.\n");
+        ret = 1;
+    }
+
+    seekgzip_close(zs);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, build = 0, decompress = 0, verify = 0, num_threads = 1, num_args = 0;
+    int inspect = 0, json = 0, sparse = 0, num_splits = 0, num_tail = -1, num_samples = 0;
+    unsigned int seed = (unsigned int)time(NULL);
+    off_t split_size = 0;
+    char *args[2] = {NULL, NULL}, *output = NULL;
+
+    // Parse the options; the rest (including a range "-END") are arguments.
+    for (i = 1;i < argc;++i) {
+        if (strcmp(argv[i], "-b") == 0) {
+            build = 1;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            decompress = 1;
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            verify = 1;
+        } else if (strcmp(argv[i], "-i") == 0) {
+            inspect = 1;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json = 1;
+        } else if (strcmp(argv[i], "--sparse") == 0) {
+            sparse = 1;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tail") == 0 && i + 1 < argc) {
+            num_tail = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+            num_samples = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--splits") == 0 && i + 1 < argc) {
+            num_splits = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--split-size") == 0 && i + 1 < argc) {
+            split_size = (off_t)strtoull(argv[++i], NULL, 10);
+        } else if (num_args < 2) {
+            args[num_args++] = argv[i];
+        } else {
+            num_args = -1;
+            break;
+        }
+    }
+
+    if (build && output != NULL && num_args == 1 && num_threads <= 1 && !sparse) {
+        return build_stream_main(args[0], output);
+    } else if (build && output == NULL && num_args == 1) {
+        return build_main(args[0], num_threads, sparse);
+    } else if (decompress && num_args == 1) {
+        return decompress_main(args[0], num_threads);
+    } else if (verify && num_args == 1) {
+        return verify_main(args[0], num_threads);
+    } else if (0 < num_samples && num_args == 1) {
+        return sample_main(args[0], num_samples, seed, num_threads);
+    } else if (0 <= num_tail && num_args == 1) {
+        return tail_main(args[0], num_tail);
+    } else if (inspect && num_args == 1) {
+        return inspect_main(args[0], json);
+    } else if ((0 < num_splits || 0 < split_size) && num_args == 1) {
+        return splits_main(args[0], num_splits, split_size);
+    } else if (!build && !decompress && !verify && !inspect && num_args == 2) {
+        return read_main(args[0], args[1]);
+    } else {
+        usage(argv[0]);
+        return 0;
     }
 }
 
@@ -1,7 +1,37 @@
 #ifndef __SEEKGZIP_H__
 #define __SEEKGZIP_H__
 
+#include <stdio.h>
+
 struct tag_seekgzip_t; typedef struct tag_seekgzip seekgzip_t;
+struct tag_seekgzip_reverse; typedef struct tag_seekgzip_reverse seekgzip_reverse_t;
+
+typedef struct {
+    off_t begin;
+    off_t end;
+} seekgzip_range_t;
+
+typedef struct {
+    off_t offset;
+    size_t size;
+    char *data;
+} seekgzip_record_t;
+
+typedef struct {
+    int version;
+    int offset_size;
+    off_t compressed_size;
+    off_t uncompressed_size;
+    int num_points;
+    size_t memory_size;
+} seekgzip_info_t;
+
+typedef struct {
+    off_t out;
+    off_t in;
+    int bits;
+    unsigned int crc;
+} seekgzip_point_t;
 
 enum {
     SEEKGZIP_SUCCESS=0,
@@ -13,6 +43,7 @@ enum {
     SEEKGZIP_OUTOFMEMORY,
     SEEKGZIP_IMCOMPATIBLE,
     SEEKGZIP_ZLIBERROR,
+    SEEKGZIP_STALEINDEX,
 };
 
 int
@@ -20,12 +51,43 @@ seekgzip_build(
     const char *filename
     );
 
+int
+seekgzip_build_parallel(
+    const char *filename,
+    int num_threads
+    );
+
+int
+seekgzip_build_sparse(
+    const char *filename,
+    int num_threads
+    );
+
+int
+seekgzip_build_stream(
+    FILE *fp,
+    const char *filename
+    );
+
+int
+seekgzip_decompress(
+    const char *filename,
+    int fd,
+    int num_threads
+    );
+
 seekgzip_t*
 seekgzip_open(
     const char *filename,
     int *errorcode
     );
 
+seekgzip_t*
+seekgzip_dup(
+    seekgzip_t* zs,
+    int *errorcode
+    );
+
 void
 seekgzip_close(
     seekgzip_t* zs
@@ -49,10 +111,87 @@ seekgzip_read(
     int size
     );
 
+off_t
+seekgzip_copy_range(
+    seekgzip_t* zs,
+    off_t begin,
+    off_t end,
+    int fd
+    );
+
+int
+seekgzip_info(
+    seekgzip_t* zs,
+    seekgzip_info_t *info
+    );
+
+int
+seekgzip_get_point(
+    seekgzip_t* zs,
+    int i,
+    seekgzip_point_t *point
+    );
+
+off_t
+seekgzip_size(
+    seekgzip_t* zs
+    );
+
+int
+seekgzip_splits(
+    seekgzip_t* zs,
+    int num,
+    int delim,
+    seekgzip_range_t *ranges
+    );
+
+seekgzip_reverse_t*
+seekgzip_reverse_open(
+    seekgzip_t* zs,
+    off_t offset,
+    int delim,
+    int *errorcode
+    );
+
+int
+seekgzip_reverse_readline(
+    seekgzip_reverse_t* rv,
+    const char **line,
+    size_t *size,
+    off_t *offset
+    );
+
+void
+seekgzip_reverse_close(
+    seekgzip_reverse_t* rv
+    );
+
+int
+seekgzip_sample(
+    seekgzip_t* zs,
+    int num,
+    unsigned int seed,
+    int delim,
+    int num_threads,
+    seekgzip_record_t *records
+    );
+
+void
+seekgzip_free_records(
+    seekgzip_record_t *records,
+    int num
+    );
+
 int
 seekgzip_error(
     seekgzip_t* sgz
     );
 
+int
+seekgzip_verify(
+    seekgzip_t* zs,
+    int num_threads
+    );
+
 #endif/*__SEEKGZIP_H__*/
 
@@ -19,7 +19,7 @@ seekgzip_module = Extension(
         'export.cpp',
         'export_python.cpp',
         ],
-    libraries=['z'],
+    libraries=['z', 'pthread'],
     extra_link_args=['-shared'],
     language='c++',
     )